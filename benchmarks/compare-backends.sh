@@ -0,0 +1,59 @@
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+# Runs the SPM builds produced by make-all.sh once per migration backend
+# (see SPM_BACKEND in the runtime README), so both can be compared.
+#
+# Usage: ./compare-backends.sh <bench>_spm [bench args...]
+#   e.g. ./compare-backends.sh easy_prod_spm_threadlock -nt 16 -nm 32 -msz 1000
+
+
+#'debug' script flag
+#set -x
+
+
+BENCH=$1
+shift
+
+#Number of runs per backend
+RUNS=5
+
+#Pages per move_pages(2) call
+BATCHES="256 1024 4096"
+
+
+if [ ! -x ./$BENCH ]; then
+echo "Usage: $0 <bench>_spm [bench args...]"
+exit 1
+fi
+
+runfunc() {
+for i in $(seq $RUNS); do
+START=$(date +%s.%N)
+./$BENCH "$@" > /dev/null
+END=$(date +%s.%N)
+echo "$LABEL $(echo "$END - $START" | bc)"
+done
+}
+
+
+LABEL="hwloc"
+SPM_BACKEND=hwloc
+export SPM_BACKEND
+runfunc "$@"
+
+for SPM_BATCH_PAGES in $BATCHES; do
+LABEL="move_pages/$SPM_BATCH_PAGES"
+SPM_BACKEND=move_pages
+export SPM_BACKEND SPM_BATCH_PAGES
+runfunc "$@"
+done
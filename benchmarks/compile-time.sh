@@ -0,0 +1,87 @@
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+# Measures the time "opt -spm" takes on the benchmark sources and on
+# synthetic loop nests (see gen-loop-nest.sh), once with each loop's
+# information computed only once per function and once recomputed at
+# every query (-loop-info-expr-cache=0), printing "<label> <seconds>" for
+# every run, then the mean of each configuration and the uncached/cached
+# ratio of each source.
+#
+# Usage: ./compile-time.sh
+
+
+#'debug' script flag
+#set -x
+
+
+#SPM vars
+LIBDIR="<your_lib_dir>"
+LIBNAME="SelectivePageMigration.so"
+
+#Number of runs per configuration
+RUNS=3
+
+#Synthetic nests, as <depth>x<arrays>
+NESTS="2x8 4x8 6x8 8x8 4x32"
+
+#Benchmark sources
+SOURCES="easy_add.cpp easy_ch.cpp easy_lu.cpp easy_prod.cpp BucketSort.c partitionStrSearch.c"
+
+
+if [ ! -f $LIBDIR/$LIBNAME ]; then
+echo "Usage: $0 (set LIBDIR to the directory of $LIBNAME first)"
+exit 1
+fi
+
+timefunc() {
+TOTAL=0
+for i in $(seq $RUNS); do
+START=$(date +%s.%N)
+opt -load $LIBDIR/$LIBNAME -spm "$@" $BENCHNAME.m2r.bc -o /dev/null
+END=$(date +%s.%N)
+echo "$LABEL $(echo "$END - $START" | bc)"
+TOTAL=$(echo "$TOTAL + $END - $START" | bc)
+done
+MEAN=$(echo "scale=3; $TOTAL / $RUNS" | bc)
+echo "$LABEL mean $MEAN"
+}
+
+measurefunc() {
+clang -emit-llvm -O0 -Wno-int-to-pointer-cast -c $SOURCE -o $BENCHNAME.bc
+opt -mem2reg -mergereturn $BENCHNAME.bc -o $BENCHNAME.m2r.bc
+
+LABEL="$BENCHNAME/cached"
+timefunc
+CACHED=$MEAN
+
+LABEL="$BENCHNAME/uncached"
+timefunc -loop-info-expr-cache=0
+
+echo "$BENCHNAME uncached/cached $(echo "scale=2; $MEAN / $CACHED" | bc)"
+
+rm -f $BENCHNAME.bc $BENCHNAME.m2r.bc
+}
+
+
+for SOURCE in $SOURCES; do
+BENCHNAME=${SOURCE%.*}
+measurefunc
+done
+
+for NEST in $NESTS; do
+BENCHNAME=nest_$NEST
+SOURCE=$BENCHNAME.c
+./gen-loop-nest.sh ${NEST%x*} ${NEST#*x} > $SOURCE
+measurefunc
+rm -f $SOURCE
+done
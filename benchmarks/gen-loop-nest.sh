@@ -0,0 +1,60 @@
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+# Writes to stdout a C file with a single perfect loop nest of the given
+# depth whose innermost body loads and stores the given number of arrays,
+# every access indexed by all the induction variables. Used by
+# compile-time.sh to stress the loop analyses of the SPM pass.
+#
+# Usage: ./gen-loop-nest.sh <depth> <arrays>
+#   e.g. ./gen-loop-nest.sh 6 16 > nest_6_16.c
+
+
+#'debug' script flag
+#set -x
+
+
+DEPTH=$1
+ARRAYS=$2
+
+if [ -z "$DEPTH" ] || [ -z "$ARRAYS" ] || [ "$DEPTH" -lt 1 ] || [ "$ARRAYS" -lt 1 ]; then
+echo "Usage: $0 <depth> <arrays>" >&2
+exit 1
+fi
+
+#nest(n, a0, a1, ...)
+PARAMS="long n"
+for a in $(seq 0 $((ARRAYS - 1))); do
+PARAMS="$PARAMS, double *a$a"
+done
+
+#i0*n^(depth-1) + ... + i<depth-1>, in Horner form
+INDEX="i0"
+for d in $(seq 1 $((DEPTH - 1))); do
+INDEX="($INDEX)*n + i$d"
+done
+
+echo "/* Generated by gen-loop-nest.sh $DEPTH $ARRAYS */"
+echo ""
+echo "void nest($PARAMS) {"
+
+for d in $(seq 0 $((DEPTH - 1))); do
+printf "%*sfor (long i$d = 0; i$d < n; i$d++)\n" $((d + 1)) ""
+done
+
+printf "%*s{\n" $DEPTH ""
+for a in $(seq 0 $((ARRAYS - 1))); do
+printf "%*sa$a[$INDEX] = a$(( (a + 1) % ARRAYS ))[$INDEX] + 1.0;\n" $((DEPTH + 1)) ""
+done
+printf "%*s}\n" $DEPTH ""
+
+echo "}"
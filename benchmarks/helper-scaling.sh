@@ -0,0 +1,41 @@
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+# Runs migrate_bw (built by make-all.sh) once per helper count (see
+# SPM_HELPERS in the runtime README), printing the migration throughput
+# of each run, so the scaling with helpers can be compared.
+#
+# Usage: ./helper-scaling.sh [migrate_bw args...]
+#   e.g. ./helper-scaling.sh -mb 2048 -r 10
+
+
+#'debug' script flag
+#set -x
+
+
+#Helper threads per node
+HELPERS="0 1 2 4 8"
+
+#Split every migration, whatever its size
+SPM_PARALLEL_BYTES=0
+export SPM_PARALLEL_BYTES
+
+
+if [ ! -x ./migrate_bw ]; then
+echo "Usage: $0 [migrate_bw args...] (build migrate_bw with make-all.sh first)"
+exit 1
+fi
+
+for SPM_HELPERS in $HELPERS; do
+export SPM_HELPERS
+./migrate_bw "$@" | sed "s|^|helpers/$SPM_HELPERS |"
+done
@@ -67,12 +67,19 @@ opt -O3 $BENCHNAME.spm_threadlock.bc -o $BENCHNAME.final_threadlock.bc
 llc $BENCHNAME.final.bc -o $BENCHNAME.s
 llc $BENCHNAME.final_threadlock.bc -o ${BENCHNAME}_threadlock.s
 
-clang++ -O3 -o ${BENCHNAME}_spm $BENCHNAME.s arglib.o $HEURISTICDIR/$HEURISTICNAME $CUSTOMHWLOC -lhwloc -lpthread
+clang++ -O3 -o ${BENCHNAME}_spm $BENCHNAME.s arglib.o $HEURISTICDIR/$HEURISTICNAME $CUSTOMHWLOC -lhwloc -lnuma -lpthread
 
-clang++ -O3 -o ${BENCHNAME}_spm_threadlock ${BENCHNAME}_threadlock.s arglib.o $HEURISTICDIR/$HEURISTICNAME $CUSTOMHWLOC -lhwloc -lpthread
+clang++ -O3 -o ${BENCHNAME}_spm_threadlock ${BENCHNAME}_threadlock.s arglib.o $HEURISTICDIR/$HEURISTICNAME $CUSTOMHWLOC -lhwloc -lnuma -lpthread
 
 rm -f *.bc
 rm -f $BENCHNAME.s ${BENCHNAME}_threadlock.s
+
+#single clang invocation: the pass runs at the end of the -O3 pipeline
+clang$ISCPP $DEBUGFLAG -O3 -Wno-int-to-pointer-cast -Xclang -load -Xclang $LIBDIR/$LIBNAME -mllvm -spm-late -mllvm -spm-loop-analysis=auto -c $BENCHNAME.c$EXTCPP -o ${BENCHNAME}_late.o
+
+clang++ -O3 -o ${BENCHNAME}_spm_late ${BENCHNAME}_late.o arglib.o $HEURISTICDIR/$HEURISTICNAME $CUSTOMHWLOC -lhwloc -lnuma -lpthread
+
+rm -f ${BENCHNAME}_late.o
 }
 
 
@@ -102,4 +109,7 @@ buildfunc
 BENCHNAME=partitionStrSearch
 buildfunc
 
+#migration throughput, linked directly with the runtime (see helper-scaling.sh)
+clang++ $DEBUGFLAG -O3 -o migrate_bw migrate_bw.cpp arglib.o $HEURISTICDIR/$HEURISTICNAME $CUSTOMHWLOC -lhwloc -lnuma -lpthread
+
 rm -f arglib.o
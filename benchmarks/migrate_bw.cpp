@@ -0,0 +1,117 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+/* Migration throughput: moves one buffer back and forth between the first
+ * and the last NUMA node through the SPM runtime (__spm_get) and prints the
+ * MB/s of each run. Linked directly with the runtime object, no pass needed;
+ * run it under helper-scaling.sh to compare SPM_HELPERS values.
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+#include <hwloc.h>
+
+#include "arglib.h"
+
+using namespace std;
+
+
+extern "C" {
+	void __spm_init();
+	void __spm_end();
+	void __spm_get(void *Ary, long Start, long End, long Reuse, long SiteId);
+}
+
+clarg::argInt bufmb("-mb", "Buffer size in MiB", 1024);
+clarg::argInt nruns("-r", "Number of migrations", 5);
+
+hwloc_topology_t topology;
+
+
+double mysecond()
+{
+	struct timeval tp;
+	struct timezone tzp;
+	gettimeofday(&tp,&tzp);
+
+	return ( (double) tp.tv_sec + (double) tp.tv_usec * 1.e-6 );
+}
+
+
+void bind_to(hwloc_obj_t node) {
+	hwloc_set_cpubind(topology, node->cpuset, HWLOC_CPUBIND_THREAD);
+}
+
+
+int main(int argc, char *argv[]) {
+	if (clarg::parse_arguments(argc, argv)) {
+		cerr << "Error when parsing the arguments!" << endl;
+		return 1;
+	}
+
+	//every call must migrate, and nothing may remember the buffer
+	setenv("SPM_HEURISTIC", "always", 0);
+	setenv("SPM_REGISTRY", "0", 0);
+	setenv("SPM_SHADOW", "0", 0);
+	//and nothing may trim it for memory pressure, or the MB/s would be wrong
+	setenv("SPM_MIN_FREE_MB", "0", 0);
+
+	hwloc_topology_init(&topology);
+	hwloc_topology_load(topology);
+
+	int nnodes = hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_NODE);
+	hwloc_obj_t first = hwloc_get_obj_by_type(topology, HWLOC_OBJ_NODE, 0);
+	hwloc_obj_t last = hwloc_get_obj_by_type(topology, HWLOC_OBJ_NODE, nnodes > 0 ? nnodes - 1 : 0);
+
+	if (first == NULL || last == NULL) {
+		cerr << "Error, no NUMA node found" << endl;
+		return 1;
+	}
+
+	if (first == last)
+		cerr << "Warning, single NUMA node, migrations will not move pages" << endl;
+
+	long size = (long)bufmb.get_value() << 20;
+	char* buf = (char*) hwloc_alloc_membind_nodeset(topology, size, first->nodeset,
+		HWLOC_MEMBIND_BIND, 0);
+
+	if (buf == NULL) {
+		cerr << "Error, could not allocate " << bufmb.get_value() << " MiB" << endl;
+		return 1;
+	}
+
+	memset(buf, 1, size);
+
+	__spm_init();
+
+	for (int r=0; r<nruns.get_value(); r++) {
+		//alternate directions, so each run finds the buffer on the other node
+		bind_to(r % 2 == 0 ? last : first);
+
+		double tempo = mysecond();
+		__spm_get(buf, 0, size, size, 0);
+		tempo = mysecond() - tempo;
+
+		cout << bufmb.get_value() / tempo << " MB/s" << endl;
+	}
+
+	__spm_end();
+
+	hwloc_free(topology, buf, size);
+	hwloc_topology_destroy(topology);
+
+	return 0;
+}
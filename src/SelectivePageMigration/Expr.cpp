@@ -548,6 +548,26 @@ Expr Expr::subs(Expr This, Expr That) const {
 }
 
 
+Expr Expr::expand() const {
+	return Expr_.expand();
+}
+
+
+bool Expr::isPolynomial(Expr Var) const {
+	return Expr_.is_polynomial(Var.getExpr());
+}
+
+
+int Expr::degree(Expr Var) const {
+	return Expr_.degree(Var.getExpr());
+}
+
+
+Expr Expr::coeff(Expr Var, int N) const {
+	return Expr_.coeff(Var.getExpr(), N);
+}
+
+
 bool Expr::match(Expr Ex, ExprMap& Map) const {
 	return Expr_.match(Ex.getExpr(), Map.getMap());
 }
@@ -563,6 +583,11 @@ bool Expr::has(Expr Ex) const {
 }
 
 
+unsigned Expr::hash() const {
+	return Expr_.gethash();
+}
+
+
 Expr Expr::InvalidExpr() {
 	static Expr Invalid(string("__INVALID__"));
 	return Invalid;
@@ -29,6 +29,7 @@
 #include "ginac/ginac.h"
 
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 using namespace llvm;
@@ -161,9 +162,14 @@ public:
 	Expr max(Expr Other) const;
 
 	Expr subs(Expr This, Expr That)   const;
+	Expr expand()                     const;
+	bool isPolynomial(Expr Var)       const;
+	int  degree(Expr Var)             const; // Of the expanded expression in Var.
+	Expr coeff(Expr Var, int N)       const; // Of Var^N, once expanded.
 	bool match(Expr Ex, ExprMap& Map) const;
 	bool match(Expr Ex)               const;
 	bool has(Expr Ex)                 const;
+	unsigned hash()                   const; // Structural: equal expressions hash alike.
 
 	static Expr InvalidExpr();
 	static Expr WildExpr();
@@ -178,4 +184,63 @@ private:
 	GiNaC::ex Expr_;
 };
 
+
+// Memoizes the results of one operation over tuples of Exprs, keyed on their
+//structural hashes; tuples whose hashes collide are told apart with eq().
+template<class T>
+class ExprCache {
+public:
+	ExprCache() : Hits_(0), Misses_(0) { }
+
+	bool lookup(const vector<Expr> &Key, T &Result) {
+		auto It = Buckets_.find( hashOf(Key) );
+
+		if ( It != Buckets_.end() )
+			for (auto &Entry : It->second)
+				if ( equal(Entry.first, Key) ) {
+					Result = Entry.second;
+					++Hits_;
+					return true;
+				}
+
+		++Misses_;
+		return false;
+	}
+
+	void insert(const vector<Expr> &Key, T Result) {
+		Buckets_[ hashOf(Key) ].push_back( std::make_pair(Key, Result) );
+	}
+
+	void clear() {
+		Buckets_.clear();
+		Hits_ = Misses_ = 0;
+	}
+
+	void print(raw_ostream &OS, const char *Name) const {
+		OS << Name << ": " << Hits_ << " hits, " << Misses_ << " misses\n";
+	}
+
+private:
+	static unsigned hashOf(const vector<Expr> &Key) {
+		unsigned Hash = 0;
+		for (auto &Ex : Key)
+			Hash = Hash * 31 + Ex.hash();
+		return Hash;
+	}
+
+	static bool equal(const vector<Expr> &LHS, const vector<Expr> &RHS) {
+		if ( LHS.size() != RHS.size() )
+			return false;
+
+		for (unsigned Idx = 0; Idx < LHS.size(); ++Idx)
+			if ( LHS[Idx].ne(RHS[Idx]) )
+				return false;
+
+		return true;
+	}
+
+	std::unordered_map< unsigned, vector< pair<vector<Expr>, T> > > Buckets_;
+	unsigned long Hits_, Misses_;
+};
+
 #endif
@@ -36,7 +36,7 @@ bool GetWorkerFunctions::runOnModule(Module &M) {
 
 					if (callInst->getCalledFunction() != nullptr)
 						if ( callInst->getCalledFunction()->getName() == "pthread_create") {
-							Value *val = (*callInst).getArgOperand(2); 
+							Value *val = (*callInst).getArgOperand(2)->stripPointerCasts(); //optimized code may cast the start routine
 							GetWorkerFunctions::workers.insert(  ( (*val).getName() ).str()  );
 						}
 				}
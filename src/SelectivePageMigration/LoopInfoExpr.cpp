@@ -23,6 +23,7 @@
 ********************************************************************* */
 #include "LoopInfoExpr.h"
 
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/ADT/SmallVector.h"
@@ -33,6 +34,17 @@
 static cl::opt<bool>	ClDebug("loop-info-expr-debug", cl::desc("Enable debugging for the loop information pass"),
 						cl::Hidden, cl::init(false));
 
+static cl::opt<bool>	ClCache("loop-info-expr-cache", cl::desc("Compute the loop information of each loop only once per function"),
+						cl::Hidden, cl::init(true));
+
+static cl::opt<LoopAnalysis>	ClLoopAnalysis("spm-loop-analysis", cl::desc("Source of the induction variables, bounds and steps of loops"),
+						cl::values(
+							clEnumValN(LOOP_ANALYSIS_PATTERN, "pattern", "i = i + <invariant> phis compared at the first loop exit"),
+							clEnumValN(LOOP_ANALYSIS_SCEV,    "scev",    "affine ScalarEvolution recurrences and backedge-taken counts"),
+							clEnumValN(LOOP_ANALYSIS_AUTO,    "auto",    "pattern, then ScalarEvolution for the loops it misses"),
+							clEnumValEnd),
+						cl::Hidden, cl::init(LOOP_ANALYSIS_PATTERN));
+
 static RegisterPass<LoopInfoExpr> X("loop-info-expr", "Loop information");
 char LoopInfoExpr::ID = 0;
 
@@ -54,8 +66,15 @@ bool LoopInfoExpr::IsLoopInvariant(Loop *L, Expr Ex) {
 }
 
 
+LoopAnalysis LoopInfoExpr::getLoopAnalysis() {
+	return ClLoopAnalysis;
+}
+
+
 void LoopInfoExpr::getAnalysisUsage(AnalysisUsage &AU) const {
 	AU.addRequired<LoopInfo>();
+	if (ClLoopAnalysis != LOOP_ANALYSIS_PATTERN) //only scev and auto use it
+		AU.addRequired<ScalarEvolution>();
 	AU.addRequired<SymPyInterface>();
 	AU.setPreservesAll();
 }
@@ -63,11 +82,18 @@ void LoopInfoExpr::getAnalysisUsage(AnalysisUsage &AU) const {
 
 bool LoopInfoExpr::runOnFunction(Function &F) {
 	LI_ = &getAnalysis<LoopInfo>();
+	SE_ = (ClLoopAnalysis != LOOP_ANALYSIS_PATTERN) ? &getAnalysis<ScalarEvolution>() : nullptr;
 	SPI_ = &getAnalysis<SymPyInterface>();
+	LoopInfos_.clear();
 	return false;
 }
 
 
+void LoopInfoExpr::printCacheStats(raw_ostream &OS) const {
+	OS << "LoopInfoExpr: loop information: " << Hits_ << " hits, " << Misses_ << " misses\n";
+}
+
+
 bool LoopInfoExpr::isInductionVariable(PHINode *Phi) {
 	if (  !LI_->isLoopHeader( Phi->getParent() )  )
 		return false;
@@ -135,25 +161,95 @@ Expr LoopInfoExpr::getExpr(Value *V) {
 
 
 bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Expr &IndvarEnd, Expr &IndvarStep) {
+	const LoopInfoResult &Res = getLoopInfoResult(L);
+
+	if (Res.Reason)
+		return false;
+
+	Indvar      = Res.Indvar;
+	IndvarStart = Res.IndvarStart;
+	IndvarEnd   = Res.IndvarEnd;
+	IndvarStep  = Res.IndvarStep;
+	return true;
+}
 
 
+const char *LoopInfoExpr::getLoopInfoFailure(Loop *L) {
+	return getLoopInfoResult(L).Reason;
+}
+
+
+bool LoopInfoExpr::isDecreasing(Loop *L) {
+	return getLoopInfoResult(L).Decreasing;
+}
+
+
+const LoopInfoExpr::LoopInfoResult &LoopInfoExpr::getLoopInfoResult(Loop *L) {
+	if (!ClCache)
+		LoopInfos_.erase(L);
+
+	auto It = LoopInfos_.find(L);
+	if ( It != LoopInfos_.end() ) {
+		++Hits_;
+		return It->second;
+	}
+
+	++Misses_;
+	LoopInfoResult Res;
+	computeLoopInfo(L, Res);
+
+	LIE_DEBUG(if (Res.Reason) dbgs() << "LoopInfoExpr: no loop info for loop at " << L->getHeader()->getName() << ": " << Res.Reason << "\n");
+
+	return LoopInfos_.insert( std::make_pair(L, Res) ).first->second;
+}
+
+
+void LoopInfoExpr::computeLoopInfo(Loop *L, LoopInfoResult &Res) {
+	Res.Reason     = nullptr;
+	Res.Indvar     = nullptr;
+	Res.Decreasing = false;
+
+	if (ClLoopAnalysis == LOOP_ANALYSIS_SCEV) {
+		computeLoopInfoSCEV(L, Res);
+		return;
+	}
+
+	computeLoopInfoPattern(L, Res);
+
+	if ( Res.Reason && ClLoopAnalysis == LOOP_ANALYSIS_AUTO ) {
+		LoopInfoResult SCEVRes = Res;
+		SCEVRes.Reason = nullptr;
+		computeLoopInfoSCEV(L, SCEVRes);
+
+		if (!SCEVRes.Reason)
+			Res = SCEVRes;
+	}
+}
+
+
+void LoopInfoExpr::computeLoopInfoPattern(Loop *L, LoopInfoResult &Res) {
 	SmallVector<BasicBlock*,4> Eblocks;
 	L->getExitingBlocks(Eblocks); //trick that allow us to analyze loops with more than 1 exiting blocks...
 
 	if(!Eblocks[0]) {
 		LIE_DEBUG(dbgs() << "LoopInfoExpr: Problem in the Eblocks vector; we probably couldn't get the exiting blocks of the loop: "<< *L << "\n" << "LoopInfoExpr: So, we're aborting the getLoopInfo() now...\n");
-		return false;
+		Res.Reason = "no exiting block";
+		return;
 	}
 	
 	TerminatorInst *TI = Eblocks[0]->getTerminator(); //..but still a simplification, since we only analyze the first exiting block
 	
 	BranchInst *BI = dyn_cast<BranchInst>(TI);
-	if (!BI)
-		return false;
+	if (!BI) {
+		Res.Reason = "exiting block does not end in a branch";
+		return;
+	}
 
 	ICmpInst *ICI = dyn_cast<ICmpInst>( BI->getCondition() );
-	if (!ICI)
-		return false;
+	if (!ICI) {
+		Res.Reason = "exit condition is not an integer comparison";
+		return;
+	}
 
 	switch ( ICI->getPredicate() ) {
 		case CmpInst::ICMP_SLT: // signed <
@@ -169,7 +265,8 @@ bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Exp
 		
 		default:
 			LIE_DEBUG(dbgs() << "LoopInfoExpr: invalid loop comparison predicate\n");
-			return false;
+			Res.Reason = "unsupported exit comparison predicate";
+			return;
 	}
 
 	//Get the toplevel loop and use it to generate all lasting expressions.
@@ -189,8 +286,10 @@ bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Exp
 
 	LIE_DEBUG(dbgs() << "LoopInfoExpr: toplevel LHS & RHS: " << LHS << ", " << RHS << "\n");
 	
-	if ( !LHS.isValid() || !RHS.isValid() )
-		return false;
+	if ( !LHS.isValid() || !RHS.isValid() ) {
+		Res.Reason = "no expression for the exit comparison";
+		return;
+	}
 
 	Expr Var, Invar;
 	if ( !IsLoopInvariant(L, LHS) && IsLoopInvariant(L, RHS) ) {
@@ -241,7 +340,8 @@ bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Exp
 		 
 		if (LHS_Val == nullptr && RHS_Val == nullptr) {
 			LIE_DEBUG(dbgs() << "LoopInfoExpr: Unfortunately...aborting this pass here. Our approach have failed...it was impossible to determine which is the invariant-to-loop value: RHS (" << RHS << ") or LHS (" << LHS << ")\n\n");
-			return false;
+			Res.Reason = "neither side of the exit comparison is loop-invariant";
+			return;
 		}
 	
 	}
@@ -253,7 +353,8 @@ bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Exp
 		
 		if (!LPreheader || !LLatch) {
 			LIE_DEBUG(dbgs() << "LoopInfoExpr: invalid loop preheader or latch...aborting this step.\n");
-			return false;
+			Res.Reason = "no preheader or no latch";
+			return;
 		}
 		
 		Value *PreheaderIncoming	=	Phi->getIncomingValueForBlock( LPreheader );
@@ -261,34 +362,41 @@ bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Exp
 
 		if ( !L->isLoopInvariant(PreheaderIncoming) || L->isLoopInvariant(LatchIncoming) ) {
 			LIE_DEBUG(dbgs() << "LoopInfoExpr: incoming value have incorrect loop-variance...aborting this step.\n");
-			return false;
+			Res.Reason = "incoming values of the induction variable have incorrect loop-variance";
+			return;
 		}
 
-		Indvar = Phi;
-		IndvarStart = getExprForLoop( Toplevel, PreheaderIncoming );
+		Res.Indvar = Phi;
+		Res.IndvarStart = getExprForLoop( Toplevel, PreheaderIncoming );
 
 		switch ( ICI->getPredicate() ) {
 			case CmpInst::ICMP_SLT:
 			case CmpInst::ICMP_ULT:
-				IndvarEnd = Invar - 1;
+				Res.IndvarEnd = Invar - 1;
 				break;
 			
 			case CmpInst::ICMP_SGT:
 			case CmpInst::ICMP_UGT:
-				IndvarEnd = Invar + 1;
+				Res.IndvarEnd = Invar + 1;
+				Res.Decreasing = true;
 				break;
 			
 			case CmpInst::ICMP_SLE:
 			case CmpInst::ICMP_ULE:
+			case CmpInst::ICMP_EQ: //added later
+				Res.IndvarEnd = Invar;
+				break;
+
 			case CmpInst::ICMP_UGE:
 			case CmpInst::ICMP_SGE:
-			case CmpInst::ICMP_EQ: //added later
-				IndvarEnd = Invar;
+				Res.IndvarEnd = Invar;
+				Res.Decreasing = true;
 				break;
 			
 			default:
 				LIE_DEBUG(dbgs() << "LoopInfoExpr: invalid loop comparison predicate\n");
-				return false;
+				Res.Reason = "unsupported exit comparison predicate";
+				return;
 		}
 	
 		ExprMap Repls;
@@ -296,18 +404,168 @@ bool LoopInfoExpr::getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Exp
 		
 		if ( !LatchIncomingEx.match(PhiEx + Wild, Repls) || Repls.size() != 1 || Repls[Wild].has(PhiEx) ) {
 			LIE_DEBUG(dbgs() << "LoopInfoExpr: could not determine accurate step\n");
-			return false;
+			Res.Reason = "could not determine the step";
+			return;
 		}
 
-		IndvarStep = Repls[Wild];
+		Res.IndvarStep = Repls[Wild];
+		Res.Reason = nullptr;
 
-		LIE_DEBUG(dbgs() << "LoopInfoExpr: induction variable, start, end, step: " << *Indvar << " => (" << IndvarStart << ", " << IndvarEnd << ", +" << IndvarStep << ")\n");
+		LIE_DEBUG(dbgs() << "LoopInfoExpr: induction variable, start, end, step: " << *Res.Indvar << " => (" << Res.IndvarStart << ", " << Res.IndvarEnd << ", +" << Res.IndvarStep << ")\n");
 		
-		return true;
+		return;
 	
 	} //if ( PHINode *Phi = getSingleLoopVariantPhi(L, Var) )
 
-	return false;
+	Res.Reason = "no single loop-variant phi in the exit comparison";
+}
+
+
+void LoopInfoExpr::computeLoopInfoSCEV(Loop *L, LoopInfoResult &Res) {
+	BasicBlock *Exiting = L->getExitingBlock();
+	BasicBlock *Latch   = L->getLoopLatch();
+
+	if ( !Exiting || !Latch || !L->getLoopPreheader() ) {
+		Res.Reason = "no single exiting block, latch or preheader";
+		return;
+	}
+
+	if ( Exiting != Latch && Exiting != L->getHeader() ) {
+		Res.Reason = "loop exits neither at its latch nor at its header";
+		return;
+	}
+
+	const SCEV *Backedges = SE_->getBackedgeTakenCount(L);
+
+	if ( isa<SCEVCouldNotCompute>(Backedges) ) {
+		Res.Reason = "no backedge-taken count";
+		return;
+	}
+
+	//the last iteration that runs the body; a loop that exits at its header
+	//goes through the header once more than through its body
+	Expr Last = getExprForSCEV(Backedges);
+
+	if ( !Last.isValid() ) {
+		Res.Reason = "no expression for the backedge-taken count";
+		return;
+	}
+
+	if (Exiting != Latch)
+		Last = Last - 1;
+
+	for (BasicBlock::iterator It = L->getHeader()->begin(); isa<PHINode>(It); ++It) {
+		PHINode *Phi = cast<PHINode>(It);
+
+		if ( !Phi->getType()->isIntegerTy() )
+			continue;
+
+		const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>( SE_->getSCEV(Phi) );
+
+		if ( !AR || AR->getLoop() != L || !AR->isAffine() )
+			continue;
+
+		Expr Start = getExprForSCEV( AR->getStart() );
+		Expr Step  = getExprForSCEV( AR->getStepRecurrence(*SE_) );
+
+		//a constant step gives the direction that the bounds depend on
+		if ( !Start.isValid() || !Step.isInteger() || Step == Expr(0L) )
+			continue;
+
+		Res.Indvar      = Phi;
+		Res.IndvarStart = Start;
+		Res.IndvarEnd   = Start + Last * Step;
+		Res.IndvarStep  = Step;
+		Res.Decreasing  = Step.isNegative();
+		Res.Reason      = nullptr;
+
+		LIE_DEBUG(dbgs() << "LoopInfoExpr: SCEV induction variable, start, end, step: " << *Res.Indvar << " => (" << Res.IndvarStart << ", " << Res.IndvarEnd << ", +" << Res.IndvarStep << ")\n");
+
+		return;
+	}
+
+	Res.Reason = "no affine induction variable with a constant step";
+}
+
+
+Expr LoopInfoExpr::getExprForSCEV(const SCEV *S) {
+	switch ( S->getSCEVType() ) {
+		case scConstant:
+			return Expr( cast<SCEVConstant>(S)->getValue()->getValue() );
+
+		case scUnknown:
+			return Expr( cast<SCEVUnknown>(S)->getValue() );
+
+		//like getExprForLoop, casts are looked through
+		case scTruncate:
+		case scZeroExtend:
+		case scSignExtend:
+			return getExprForSCEV( cast<SCEVCastExpr>(S)->getOperand() );
+
+		//Expr has no floor, so only divisions known to be exact are kept
+		case scUDivExpr: {
+			const SCEVUDivExpr *Div = cast<SCEVUDivExpr>(S);
+			const SCEVConstant *LHS = dyn_cast<SCEVConstant>( Div->getLHS() );
+			const SCEVConstant *RHS = dyn_cast<SCEVConstant>( Div->getRHS() );
+
+			if ( RHS && RHS->getValue()->isOne() )
+				return getExprForSCEV( Div->getLHS() );
+
+			if ( !LHS || !RHS || RHS->getValue()->isZero()
+					|| LHS->getValue()->getValue().urem( RHS->getValue()->getValue() ) != 0 )
+				return Expr::InvalidExpr();
+
+			return Expr( LHS->getValue()->getValue().udiv( RHS->getValue()->getValue() ) );
+		}
+
+		case scAddExpr:
+		case scMulExpr:
+		case scSMaxExpr:
+		case scUMaxExpr: {
+			const SCEVNAryExpr *NAry = cast<SCEVNAryExpr>(S);
+			Expr Acc;
+
+			for (unsigned Idx = 0; Idx < NAry->getNumOperands(); ++Idx) {
+				Expr Op = getExprForSCEV( NAry->getOperand(Idx) );
+
+				if ( !Op.isValid() )
+					return Expr::InvalidExpr();
+
+				if (Idx == 0)
+					Acc = Op;
+				else if ( S->getSCEVType() == scAddExpr )
+					Acc = Acc + Op;
+				else if ( S->getSCEVType() == scMulExpr )
+					Acc = Acc * Op;
+				else
+					Acc = Acc.max(Op);
+			}
+
+			return Acc;
+		}
+
+		case scAddRecExpr: {
+			const SCEVAddRecExpr *AR = cast<SCEVAddRecExpr>(S);
+			PHINode *Indvar;
+			Expr IndvarStart, IndvarEnd, IndvarStep;
+
+			if ( !AR->isAffine() || !getLoopInfo(AR->getLoop(), Indvar, IndvarStart, IndvarEnd, IndvarStep) )
+				return Expr::InvalidExpr();
+
+			Expr Start = getExprForSCEV( AR->getStart() );
+			Expr Step  = getExprForSCEV( AR->getStepRecurrence(*SE_) );
+
+			if ( !Start.isValid() || !Step.isValid() )
+				return Expr::InvalidExpr();
+
+			//{Start,+,Step} at the iteration the induction variable is on
+			return Start + Step * ( (Expr(Indvar) - IndvarStart) / IndvarStep );
+		}
+
+		default:
+			LIE_DEBUG(dbgs() << "LoopInfoExpr: unhandled SCEV " << *S << "\n");
+			return Expr::InvalidExpr();
+	}
 }
 
 
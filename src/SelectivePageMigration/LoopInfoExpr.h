@@ -28,16 +28,28 @@
 #include "PythonInterface.h"
 
 #include "llvm/Pass.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/Instructions.h"
 
 
+// Where the induction variable, bounds and step of loops come from
+//(-spm-loop-analysis).
+enum LoopAnalysis {
+	LOOP_ANALYSIS_PATTERN, // i = i + <invariant> phis compared at the first exit
+	LOOP_ANALYSIS_SCEV,    // affine ScalarEvolution recurrences & backedge-taken counts
+	LOOP_ANALYSIS_AUTO     // pattern, then ScalarEvolution for the loops it misses
+};
+
+
 class LoopInfoExpr : public FunctionPass {
 public:
 	static char ID;
-	LoopInfoExpr() : FunctionPass(ID) { }
+	LoopInfoExpr() : FunctionPass(ID), Hits_(0), Misses_(0) { }
 
 	static bool IsLoopInvariant(Loop *L, Expr Ex);
+	static LoopAnalysis getLoopAnalysis();
 
 	virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 	virtual bool runOnFunction(Function &F);
@@ -54,11 +66,42 @@ public:
 	// Returns the induction variable for the given loop & its start, end, & step.
 	bool getLoopInfo(Loop *L, PHINode *&Indvar, Expr &IndvarStart, Expr &IndvarEnd, Expr &IndvarStep);
 
+	// Why getLoopInfo failed for L, or nullptr if it succeeded.
+	const char *getLoopInfoFailure(Loop *L);
+
+	// Whether the induction variable of L goes down from its start to its end.
+	bool isDecreasing(Loop *L);
+
+	// Builds an expression for a SCEV; add recurrences are written in terms of
+	//the induction variable of their loop.
+	Expr getExprForSCEV(const SCEV *S);
+
+	// Prints how many getLoopInfo queries the per-loop cache answered.
+	void printCacheStats(raw_ostream &OS) const;
+
 private:
+	// What getLoopInfo found for a loop; Reason is set when it failed.
+	struct LoopInfoResult {
+		const char *Reason;
+		PHINode *Indvar;
+		Expr IndvarStart, IndvarEnd, IndvarStep;
+		bool Decreasing;
+	};
+
+	const LoopInfoResult &getLoopInfoResult(Loop *L);
+	void computeLoopInfo(Loop *L, LoopInfoResult &Res);
+	void computeLoopInfoPattern(Loop *L, LoopInfoResult &Res);
+	void computeLoopInfoSCEV(Loop *L, LoopInfoResult &Res);
+
 	PHINode *getSingleLoopVariantPhi(Loop *L, Expr Ex);
 	
 	LoopInfo *LI_;
+	ScalarEvolution *SE_;
 	SymPyInterface *SPI_;
+
+	// getLoopInfo results for the loops of the current function.
+	DenseMap<Loop*, LoopInfoResult> LoopInfos_;
+	unsigned Hits_, Misses_;
 };
 
 #endif
@@ -229,10 +229,31 @@ bool SymPyInterface::runOnModule(Module&) {
   ObjVec_ = PI_->createObjVec(getObjVecInit());
   assert(ObjVec_);
 
+  // Objects left from a previous module belong to an interpreter that has
+  // been finalized since; drop them without touching their references.
+  ConvCache_.clear();
+
   return false;
 }
 
 PyObject *SymPyInterface::conv(Expr Ex) {
+  PyObject *Obj;
+  if (!ConvCache_.lookup({Ex}, Obj)) {
+    Obj = convUncached(Ex);
+    Py_XINCREF(Obj);
+    ConvCache_.insert({Ex}, Obj);
+  }
+
+  // Callers hand the result to tuples that steal it; give them their own.
+  Py_XINCREF(Obj);
+  return Obj;
+}
+
+void SymPyInterface::printCacheStats(raw_ostream &OS) const {
+  ConvCache_.print(OS, "SymPyInterface: Expr to PyObject conversions");
+}
+
+PyObject *SymPyInterface::convUncached(Expr Ex) {
   if (Ex.isSymbol()) {
     PyObject *Var = var(Ex.getSymbolString().c_str());
     return Var;
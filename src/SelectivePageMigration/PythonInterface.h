@@ -151,6 +151,8 @@ public:
 
   virtual bool runOnModule(Module&);
 
+  // Conversions are memoized for the module being processed; the cache
+  //holds its own reference to every object it returns.
   PyObject *conv(Expr Ex);
   Expr      conv(PyObject *Obj);
 
@@ -181,9 +183,14 @@ public:
   PyObject *summation(PyObject *Expr, PyObject *Var,
                       PyObject *Lower, PyObject *Upper);
 
+  void printCacheStats(raw_ostream &OS) const;
+
 private:
+  PyObject *convUncached(Expr Ex);
+
   PythonInterface *PI_;
   PythonObjVec *ObjVec_;
+  ExprCache<PyObject*> ConvCache_;
 };
 
 raw_ostream& operator<<(raw_ostream& OS, PyObject &Obj);
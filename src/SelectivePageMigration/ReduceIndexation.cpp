@@ -23,6 +23,7 @@
 ********************************************************************* */
 #include "ReduceIndexation.h"
 
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 
@@ -46,12 +47,16 @@ char ReduceIndexation::ID = 0;
 void ReduceIndexation::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<DataLayout>();
   AU.addRequired<LoopInfoExpr>();
+  if (LoopInfoExpr::getLoopAnalysis() != LOOP_ANALYSIS_PATTERN)
+    AU.addRequired<ScalarEvolution>();
   AU.setPreservesAll();
 }
 
 bool ReduceIndexation::runOnFunction(Function &F) {
   DL_  = &getAnalysis<DataLayout>();
   LIE_ = &getAnalysis<LoopInfoExpr>();
+  SE_  = LoopInfoExpr::getLoopAnalysis() != LOOP_ANALYSIS_PATTERN
+             ? &getAnalysis<ScalarEvolution>() : nullptr;
   return false;
 }
 
@@ -96,8 +101,60 @@ bool ReduceIndexation::reduceGetElementPtr(GetElementPtrInst *GEP, Value *&Array
 
 bool ReduceIndexation::reduceMemoryOp(Value *Ptr, Value *&Array,
                                       Expr& Subscript) const {
+  switch (LoopInfoExpr::getLoopAnalysis()) {
+  case LOOP_ANALYSIS_SCEV:
+    return reduceSCEV(Ptr, Array, Subscript) ||
+           reduceGEPs(Ptr, Array, Subscript);
+
+  case LOOP_ANALYSIS_AUTO: {
+    Value *GEPArray = nullptr;
+    Expr GEPSubscript = Subscript;
+    bool Reduced = reduceGEPs(Ptr, GEPArray, GEPSubscript);
+
+    // A phi base is a pointer induction variable, which only SCEV sees through.
+    if ((!Reduced || isa<PHINode>(GEPArray)) &&
+        reduceSCEV(Ptr, Array, Subscript))
+      return true;
+
+    Array = GEPArray;
+    Subscript = GEPSubscript;
+    return Reduced;
+  }
+
+  default:
+    return reduceGEPs(Ptr, Array, Subscript);
+  }
+}
+
+bool ReduceIndexation::reduceSCEV(Value *Ptr, Value *&Array,
+                                  Expr& Subscript) const {
+  if (!SE_->isSCEVable(Ptr->getType()))
+    return false;
+
+  const SCEV *PtrSCEV = SE_->getSCEV(Ptr);
+  const SCEVUnknown *Base = dyn_cast<SCEVUnknown>(SE_->getPointerBase(PtrSCEV));
+  if (!Base)
+    return false;
+
+  // The offset in bytes from the base, with the add recurrences of every
+  // loop around the access written in terms of their induction variables.
+  Expr Offset = LIE_->getExprForSCEV(SE_->getMinusSCEV(PtrSCEV, Base));
+  if (!Offset.isValid())
+    return false;
+
+  Array = Base->getValue();
+  Subscript = Subscript + Offset;
+  return true;
+}
+
+bool ReduceIndexation::reduceGEPs(Value *Ptr, Value *&Array,
+                                  Expr& Subscript) const {
+  // Vectorized accesses reach their GEP through a cast of its pointer.
+  if (BitCastInst *BC = dyn_cast<BitCastInst>(Ptr))
+    return reduceGEPs(BC->getOperand(0), Array, Subscript);
+
   if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Ptr)) {
-    if (reduceMemoryOp(GEP->getPointerOperand(), Array, Subscript)) {
+    if (reduceGEPs(GEP->getPointerOperand(), Array, Subscript)) {
       Type *Ty = GEP->getPointerOperand()->getType();
 
       for (unsigned Idx = 1; Idx < GEP->getNumOperands(); ++Idx) {
@@ -28,6 +28,7 @@
 #include "LoopInfoExpr.h"
 
 #include "llvm/Pass.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Instructions.h"
 
@@ -46,8 +47,12 @@ public:
   bool reduceMemoryOp(Value *V, Value *&Array, Expr& Offset)   const;
 
 private:
+  bool reduceGEPs(Value *V, Value *&Array, Expr &Offset) const;
+  bool reduceSCEV(Value *V, Value *&Array, Expr &Offset) const;
+
   DataLayout *DL_;
   LoopInfoExpr *LIE_;
+  ScalarEvolution *SE_;
 };
 
 #endif
@@ -22,6 +22,7 @@
  *   <http://dx.doi.org/10.1145/2628071.2628077>
 ********************************************************************* */
 #include "RelativeExecutions.h"
+#include "Summation.h"
 
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
@@ -33,6 +34,16 @@
 static cl::opt<bool>	ClDebug("rel-exec-debug", cl::desc("Enable debugging for the relative execution pass"),
 						cl::Hidden, cl::init(false));
 
+enum SummationEngine { SUMMATION_SYMPY, SUMMATION_NATIVE, SUMMATION_CHECK };
+
+static cl::opt<SummationEngine>	ClSummation("spm-summation", cl::desc("Engine for the closed forms of loop trip counts"),
+						cl::values(
+							clEnumValN(SUMMATION_SYMPY,  "sympy",  "SymPy, through the embedded Python interpreter"),
+							clEnumValN(SUMMATION_NATIVE, "native", "Faulhaber's formulas over Expr; SymPy for non-polynomial summands"),
+							clEnumValN(SUMMATION_CHECK,  "check",  "native, reporting every result SymPy disagrees with"),
+							clEnumValEnd),
+						cl::Hidden, cl::init(SUMMATION_SYMPY));
+
 static RegisterPass<RelativeExecutions> X("rel-exec", "Location-relative execution count inference");
 char RelativeExecutions::ID = 0;
 
@@ -51,6 +62,12 @@ void RelativeExecutions::getAnalysisUsage(AnalysisUsage &AU) const {
 }
 
 
+bool RelativeExecutions::doInitialization(Module &M) {
+	SumCache_.clear();
+	return false;
+}
+
+
 bool RelativeExecutions::runOnFunction(Function &F) {
 	DT_  = &getAnalysis<DominatorTree>();
 	LI_  = &getAnalysis<LoopInfo>();
@@ -60,93 +77,136 @@ bool RelativeExecutions::runOnFunction(Function &F) {
 }
 
 
+// SymPy rebuilds the symbols it returns from their names; map them back to
+//the symbols of the input, so that later sums over them still see them.
+static Expr restoreSymbols(Expr Ex, const std::vector<Expr> &Originals) {
+	for (auto &Sym : Ex.getSymbols())
+		for (auto &Orig : Originals)
+			if ( Sym.getSymbolString() == Orig.getSymbolString() && Sym != Orig ) {
+				Ex = Ex.subs(Sym, Orig);
+				break;
+			}
+
+	return Ex;
+}
+
+
+Expr RelativeExecutions::sumSymPy(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper) {
+	PyObject *SummandObj = SPI_->conv(Summand);
+	PyObject *VarObj     = SPI_->conv(Var);
+	PyObject *LowerObj   = SPI_->conv(Lower);
+	PyObject *UpperObj   = SPI_->conv(Upper);
+
+	if ( (SummandObj == nullptr) || (VarObj == nullptr) || (LowerObj == nullptr) || (UpperObj == nullptr) ) {
+		RE_DEBUG(dbgs() << "RelativeExecutions: some PyObject is null - returning InvalidExpr\n");
+		return Expr::InvalidExpr();
+	}
+
+	PyObject *Summation = SPI_->summation(SummandObj, VarObj, LowerObj, UpperObj);
+	if (Summation == nullptr)
+		return Expr::InvalidExpr();
+
+	Summation = SPI_->expand(Summation);
+	if (Summation == nullptr)
+		return Expr::InvalidExpr();
+
+	std::vector<Expr> Originals = Summand.getSymbols();
+	for (auto &Bound : { Lower, Upper })
+		for (auto &Sym : Bound.getSymbols())
+			Originals.push_back(Sym);
+
+	return restoreSymbols(SPI_->conv(Summation), Originals);
+}
+
+
+Expr RelativeExecutions::sum(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper) {
+	if ( !Summand.isValid() || !Lower.isValid() || !Upper.isValid() )
+		return Expr::InvalidExpr();
+
+	Expr Result;
+	if ( SumCache_.lookup({Summand, Var, Lower, Upper}, Result) )
+		return Result;
+
+	Result = sumEngine(Summand, Var, Lower, Upper);
+	SumCache_.insert({Summand, Var, Lower, Upper}, Result);
+
+	return Result;
+}
+
+
+Expr RelativeExecutions::sumEngine(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper) {
+	if (ClSummation == SUMMATION_SYMPY)
+		return sumSymPy(Summand, Var, Lower, Upper);
+
+	Expr Native = summation(Summand, Var, Lower, Upper);
+
+	if ( !Native.isValid() ) {
+		RE_DEBUG(dbgs() << "RelativeExecutions: no closed form for " << Summand << ", using SymPy\n");
+		return sumSymPy(Summand, Var, Lower, Upper);
+	}
+
+	if (ClSummation == SUMMATION_CHECK) {
+		Expr Reference = sumSymPy(Summand, Var, Lower, Upper);
+
+		if ( !Reference.isValid() || (Native - Reference).expand() != Expr(0L) )
+			errs() << "RelativeExecutions: summation mismatch for " << Summand << " over " << Var
+				   << " in [" << Lower << ", " << Upper << "]: native " << Native << ", SymPy " << Reference << "\n";
+	}
+
+	return Native;
+}
+
+
 Expr RelativeExecutions::getExecutionsRelativeTo(Loop *L, Loop *Toplevel, Loop *&Final) {
 	PHINode *Indvar;
 	Expr IndvarStart, IndvarEnd, IndvarStep;
 
 	if ( !LIE_->getLoopInfo(L, Indvar, IndvarStart, IndvarEnd, IndvarStep) ) {
-		RE_DEBUG(dbgs() << "RelativeExecutions: could not get loop info for loop at " << L->getHeader()->getName() << "\n");
+		RE_DEBUG(dbgs() << "RelativeExecutions: could not get loop info for loop at " << L->getHeader()->getName() << ": " << LIE_->getLoopInfoFailure(L) << "\n");
 		return Expr::InvalidExpr();
 	}
 
 	RE_DEBUG(dbgs() << "RelativeExecutions: induction variable, start, end, step: "	<< *Indvar << " => (" << IndvarStart << ", " << IndvarEnd << ", +" << IndvarStep << ")\n");
 
-	
-	PyObject *Summation = nullptr;
-	{
-		PyObject *IndvarObj       = SPI_->conv(Indvar);
-		PyObject *IndvarStepObj   = SPI_->conv(IndvarStep);
-		PyObject *IndvarStartObj  = SPI_->conv(IndvarStart);
-		PyObject *IndvarEndObj    = SPI_->conv(IndvarEnd);
-
-		//assert( IndvarObj && IndvarStepObj && IndvarStartObj && IndvarEndObj && "Conversion error" );
+	//every iteration of L counts 1/Step: the induction variable goes through
+	//Start..End in steps of Step
+	Expr Summation = sum(Expr(1L) / IndvarStep, Expr(Indvar), IndvarStart, IndvarEnd);
 
-		if ( (IndvarObj == nullptr) || (IndvarStepObj == nullptr) || (IndvarStartObj == nullptr) || (IndvarEndObj == nullptr) ) {
-			RE_DEBUG(dbgs() << "RelativeExecutions: some PyObject is null - returning InvalidExpr\n");
-			return Expr::InvalidExpr();			
-		}
-
-		PyObject *Summand = SPI_->inverse(IndvarStepObj);
-		Summation = SPI_->summation(Summand, IndvarObj, IndvarStartObj, IndvarEndObj);
-		
-		RE_DEBUG(dbgs() << "RelativeExecutions: summation for loop at " << L->getHeader()->getName() << " is: " << *Summation << "\n");
+	if ( !Summation.isValid() ) {
+		RE_DEBUG(dbgs() << "RelativeExecutions: could not sum over loop at " << L->getHeader()->getName() << "\n");
+		return Expr::InvalidExpr();
 	}
 
-	Expr Ret;
-  
+	RE_DEBUG(dbgs() << "RelativeExecutions: summation for loop at " << L->getHeader()->getName() << " is: " << Summation << "\n");
+
 	while (  (Final = L) && ( L = L->getParentLoop() )  ) {
-    
+
 		if ( !LIE_->getLoopInfo(L, Indvar, IndvarStart, IndvarEnd, IndvarStep) ) {
-			RE_DEBUG(dbgs() << "RelativeExecutions: could not get loop info for loop at " << L->getHeader()->getName() << "\n");
-			
-			Ret = SPI_->conv(Summation); 
-			RE_DEBUG(dbgs() << "RelativeExecutions: partial success; returning " << Ret << "\n");
-			
-			return Ret;
+			RE_DEBUG(dbgs() << "RelativeExecutions: could not get loop info for loop at " << L->getHeader()->getName() << ": " << LIE_->getLoopInfoFailure(L) << "\n");
+			RE_DEBUG(dbgs() << "RelativeExecutions: partial success; returning " << Summation << "\n");
+
+			return Summation;
 		}
 
 		RE_DEBUG(dbgs() << "RelativeExecutions: induction variable, start, end, step: " << *Indvar << " => (" << IndvarStart << ", " << IndvarEnd << ", +" << IndvarStep << ")\n");
 
-		Expr SummationEx = SPI_->conv(Summation);
-		Summation = SPI_->conv(SummationEx);
-
-		PyObject *IndvarObj       = SPI_->conv(Indvar);
-		PyObject *IndvarStepObj   = SPI_->conv(IndvarStep);
-		PyObject *IndvarStartObj  = SPI_->conv(IndvarStart);
-		PyObject *IndvarEndObj    = SPI_->conv(IndvarEnd);
-		
-		//assert(IndvarObj && IndvarStepObj && IndvarStartObj && IndvarEndObj && "Conversion error");
+		Summation = sum(Summation / IndvarStep, Expr(Indvar), IndvarStart, IndvarEnd);
 
-		if ( (IndvarObj == nullptr) || (IndvarStepObj == nullptr) || (IndvarStartObj == nullptr) || (IndvarEndObj == nullptr) ) {
-			RE_DEBUG(dbgs() << "RelativeExecutions: some PyObject is null - returning InvalidExpr\n");
-			return Expr::InvalidExpr();			
+		if ( !Summation.isValid() ) {
+			RE_DEBUG(dbgs() << "RelativeExecutions: could not sum over loop at " << L->getHeader()->getName() << "\n");
+			return Expr::InvalidExpr();
 		}
 
-		PyObject *Inverse = SPI_->inverse(IndvarStepObj);
-
-		if (Inverse == nullptr) {
-			RE_DEBUG(dbgs() << "RelativeExecutions: some PyObject is null - returning InvalidExpr\n");
-			return Expr::InvalidExpr();			
-		}
-
-		PyObject *Summand = SPI_->mul(Summation, Inverse);
-		
-		Summation = SPI_->summation(Summand, IndvarObj, IndvarStartObj, IndvarEndObj);
-		Summation = SPI_->expand(Summation);
-		
-		RE_DEBUG(dbgs() << "RelativeExecutions: summation for loop at " << L->getHeader()->getName() << " is: " << *Summation << "\n");
+		RE_DEBUG(dbgs() << "RelativeExecutions: summation for loop at " << L->getHeader()->getName() << " is: " << Summation << "\n");
 
 		if (L == Toplevel)
 			break;
-	} //while (  (Final = L) && ( L = L->getParentLoop() )  ) 
+	} //while (  (Final = L) && ( L = L->getParentLoop() )  )
 
 
 	if ( L == Toplevel || !Toplevel ) {
-		Expr Ret_final = SPI_->conv(Summation);
-		
-		RE_DEBUG(dbgs() << "RelativeExecutions: success; returning " << Ret_final << "\n");
-		
-		return Ret_final;
+		RE_DEBUG(dbgs() << "RelativeExecutions: success; returning " << Summation << "\n");
+		return Summation;
 	}
 
 	else {
@@ -155,3 +215,8 @@ Expr RelativeExecutions::getExecutionsRelativeTo(Loop *L, Loop *Toplevel, Loop *
 	}
 
 }
+
+
+void RelativeExecutions::printCacheStats(raw_ostream &OS) const {
+	SumCache_.print(OS, "RelativeExecutions: summations");
+}
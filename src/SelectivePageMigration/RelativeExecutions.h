@@ -38,6 +38,7 @@ public:
 	RelativeExecutions() : FunctionPass(ID) { }
 
 	virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+	virtual bool doInitialization(Module &M);
 	virtual bool runOnFunction(Function &F);
 
 	// Returns the number of times a basic block whose immediate
@@ -45,11 +46,23 @@ public:
 	//Final will indicate the outer-most loop that was reached.
 	Expr getExecutionsRelativeTo(Loop *L, Loop *Toplevel, Loop *&Final);
 
+	void printCacheStats(raw_ostream &OS) const;
+
 private:
+	// Sum of Summand for Var from Lower to Upper with the engine selected by
+	//-spm-summation.
+	Expr sum(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper);
+	Expr sumEngine(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper);
+	Expr sumSymPy(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper);
+
 	DominatorTree  *DT_;
 	LoopInfo       *LI_;
 	LoopInfoExpr   *LIE_;
 	SymPyInterface *SPI_;
+
+	// Sums already computed in this module, keyed on (Summand, Var, Lower,
+	//Upper): every access in a loop nest asks for the same ones.
+	ExprCache<Expr> SumCache_;
 };
 
 #endif
@@ -110,19 +110,6 @@ bool RelativeMinMax::getMinMax(Expr Ex, Expr &Min, Expr &Max) {
 				Expr IndvarStart, IndvarEnd, IndvarStep;
 				LIE_->getLoopInfo(L, Phi, IndvarStart, IndvarEnd, IndvarStep);
 				
-				SmallVector<BasicBlock*,4> Eblocks;
-				L->getExitingBlocks(Eblocks);
-
-				if(!Eblocks[0]) {
-					RMM_DEBUG(dbgs() << "RelativeMinMax: Problem in the Eblocks vector; we probably couldn't get the exiting blocks of the loop: "<< L << "\n" << "RelativeMinMax: So, we're aborting the min/max evaluating now...\n");
-					return false;
-				}
-				
-				TerminatorInst *TI = Eblocks[0]->getTerminator(); //simplification - we only look at the first exit
-				BranchInst *BI = cast<BranchInst>(TI);
-	
-				ICmpInst *ICI = cast<ICmpInst>( BI->getCondition() );
-
 				Expr MinStart, MaxStart, MinEnd, MaxEnd;
 				
 				if ( !getMinMax(IndvarStart, MinStart, MaxStart) || !getMinMax(IndvarEnd, MinEnd, MaxEnd) ) {
@@ -133,28 +120,15 @@ bool RelativeMinMax::getMinMax(Expr Ex, Expr &Min, Expr &Max) {
 				// FIXME: we should wrap the loop in a conditional so that the following
 				// min/max assumptions always hold.
 
-				switch ( ICI->getPredicate() ) {
-					case CmpInst::ICMP_SLT:
-					case CmpInst::ICMP_ULT:
-					case CmpInst::ICMP_SLE:
-					case CmpInst::ICMP_ULE:
-					case CmpInst::ICMP_EQ:  // (added later)		
-						Min = MinStart;
-						Max = MaxEnd;
-						break;
-				
-					case CmpInst::ICMP_SGT:
-					case CmpInst::ICMP_UGT:
-					case CmpInst::ICMP_UGE:
-					case CmpInst::ICMP_SGE:
-						Min = MaxStart;
-						Max = MinEnd;
-						break;
-				
-					default:
-						//llvm_unreachable("Invalid comparison predicate");
-						RMM_DEBUG(dbgs() << "RelativeMinMax: couldn't get min/max for induction variable " << *Phi << "\nRelativeMinMax: invalid comparison predicate\n");
-						return false;
+				// The direction, from the exit comparison or from the sign of the
+				//SCEV step, tells which of the bounds is the lower one.
+				if ( !LIE_->isDecreasing(L) ) {
+					Min = MinStart;
+					Max = MaxEnd;
+				}
+				else {
+					Min = MaxStart;
+					Max = MinEnd;
 				}
 				
 				RMM_DEBUG(dbgs() << "RelativeMinMax: min/max for induction variable " << *Phi << ": " << Min << ", " << Max << "\n");
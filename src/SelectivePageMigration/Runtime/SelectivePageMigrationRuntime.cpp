@@ -26,10 +26,16 @@
 #include <cmath>
 #include <iostream>
 #include <map>
-#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <list>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <functional>
+#include <limits>
 
 #include "hwloc.h"
 #include <numaif.h>
@@ -37,8 +43,19 @@
 #include <ctime>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <malloc.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef __DEBUG__
 #define SPMR_DEBUG(X) X
@@ -50,19 +67,101 @@
 #define REUSE_CTE 200
 #endif
 
+#ifndef BATCH_PAGES
+#define BATCH_PAGES 1024
+#endif
+
+#ifndef QUEUE_SIZE
+#define QUEUE_SIZE 256
+#endif
+
+#ifndef RESIDENCY_US
+#define RESIDENCY_US 100000
+#endif
+
+#ifndef REGISTRY_SHARDS
+#define REGISTRY_SHARDS 64
+#endif
+
+#ifndef INTERLEAVE_US
+#define INTERLEAVE_US 100000
+#endif
+
+#ifndef SHADOW_CHUNKS
+#define SHADOW_CHUNKS 4096
+#endif
+
+#ifndef SITE_SLOTS
+#define SITE_SLOTS 4096
+#endif
+
+#ifndef ADAPTIVE_SAMPLES
+#define ADAPTIVE_SAMPLES 4
+#endif
+
+#ifndef ADAPTIVE_PERIOD
+#define ADAPTIVE_PERIOD 256
+#endif
+
+#ifndef RETRIES
+#define RETRIES 3
+#endif
+
+#ifndef RETRY_US
+#define RETRY_US 50
+#endif
+
+#ifndef MIN_FREE_MB
+#define MIN_FREE_MB 0
+#endif
+
+#ifndef FREE_REFRESH_MS
+#define FREE_REFRESH_MS 100
+#endif
+
+#ifndef PARALLEL_BYTES
+#define PARALLEL_BYTES (64L << 20)
+#endif
+
+#ifndef REMAP_BYTES
+#define REMAP_BYTES (4L << 20)
+#endif
+
+#ifndef CHUNK_BYTES
+#define CHUNK_BYTES (8L << 20)
+#endif
+
+#ifndef SMAPS_REFRESH_US
+#define SMAPS_REFRESH_US 1000000
+#endif
+
+#ifndef MOVE_THREAD_MIN_BYTES
+#define MOVE_THREAD_MIN_BYTES (16L << 20)
+#endif
+
 extern "C" {
   void __spm_init();
   void __spm_end();
-  void __spm_get (void *Array, long Start, long End, long Reuse);
+  void __spm_get (void *Array, long Start, long End, long Reuse, long Site);
+  void *__spm_replicate(void *Array, long Start, long End, long Reuse, long Site);
+  void __spm_invalidate(void *Array, long Start, long End);
+  void __spm_invalidate_all();
+  void __spm_release(void *Array, long Start, long End);
+  void __spm_forget(void *Array, long Bytes);
+  void __spm_forget_block(void *Block);
+  void __spm_register_sites(const void *Sites, long NumSites);
+  void __spm_loop_begin(long Site);
+  void __spm_loop_end(long Site);
   void __spm_thread_lock();
   void __spm_thread_unlock();
 }
 
-const double __spm_ReuseConstant = REUSE_CTE;
-const double __spm_CacheConstant = 0.2;
+double __spm_ReuseConstant = REUSE_CTE;
+double __spm_CacheConstant = 0.2;
 
-const long PAGE_EXP  = 12;
-const long PAGE_SIZE = (1 << PAGE_EXP);
+//base page size, from sysconf in __spm_init
+long __spm_page_exp  = 12;
+long __spm_page_size = (1 << 12);
 
 hwloc_topology_t __spm_topo;
 hwloc_bitmap_t __spm_full_cpuset;
@@ -71,9 +170,82 @@ unsigned long __spm_cache_size = 0;
 //thread distribution mechanism
 hwloc_bitmap_t* __spm_nodes;
 int __spm_num_nodes;
-int __spm_current_node;
 
-static std::mutex __spm_lock;
+//migration backends, selected with SPM_BACKEND=hwloc|move_pages|remap
+enum MigrationBackend {
+	SPM_BACKEND_HWLOC,
+	SPM_BACKEND_MOVE_PAGES,
+	SPM_BACKEND_REMAP //copy and remap large ranges, hwloc for the rest
+};
+
+MigrationBackend __spm_backend = SPM_BACKEND_HWLOC;
+long __spm_batch_pages = BATCH_PAGES;
+
+hwloc_bitmap_t* __spm_node_cpusets;
+int* __spm_node_os_index;
+
+//per-page outcome of a migration request
+struct MigrationStatus {
+	long Moved;  //now on the destination node
+	long Local;  //already on the destination node, skipped
+	long Absent; //not populated yet, skipped
+	long Busy;   //kernel reported -EBUSY
+	long Failed; //any other error
+};
+
+std::atomic<long> __spm_pages_moved(0);
+std::atomic<long> __spm_pages_local(0);
+std::atomic<long> __spm_pages_busy(0);
+std::atomic<long> __spm_pages_failed(0);
+
+//CPU (OS index) -> logical node index, -1 for CPUs outside every node
+int* __spm_cpu_node;
+int __spm_num_cpus;
+
+struct SiteStats;
+
+//one execution of a site's loop being timed (SPM_ADAPTIVE=1)
+struct LoopTimer {
+	SiteStats *Site;
+	long Start;   //ns
+	bool Migrate; //whether __spm_get may migrate in this execution
+	bool Probe;   //whether the time is a sample for the site's decision
+	long ProbeStart; //the probe the sample belongs to
+};
+
+//probe executions of a site's loop made by one thread in the current probe
+struct ProbeCursor {
+	SiteStats *Site;
+	long ProbeStart;
+	long Runs;
+};
+
+// Per-thread view of where the thread runs, created on first use and only
+//refreshed when the thread is rebound or sched_getcpu() reports a CPU other
+//than the cached one.
+struct ThreadContext {
+	int Cpu;
+	int Node;
+	hwloc_const_bitmap_t Cpuset;  //CPUs of Node
+	hwloc_const_bitmap_t Nodeset; //Node itself
+
+	//scratch buffers for move_pages(2)
+	std::vector<void*> Pages, ToMove, Retry;
+	std::vector<int> PageStatus, Nodes;
+
+	//loops of the thread being timed, innermost last
+	std::vector<LoopTimer> Timers;
+	std::vector<ProbeCursor> Probes;
+
+	//slot taken in the placement ledger by __spm_thread_lock
+	int PlacedNode, PlacedCore;
+
+	ThreadContext() : Cpu(-1), Node(-1), Cpuset(NULL), Nodeset(NULL), PlacedNode(-1), PlacedCore(-1) { }
+};
+
+static thread_local ThreadContext __spm_context;
+
+long __spm_min_residency = RESIDENCY_US;
 
 /*
 typedef struct
@@ -163,335 +335,3532 @@ void print_log(PageMap *map) {
 }
 */
 
-/*
-class PageIntervals {
-private:
-  struct PageRegion {
-    long Start, End;
-    bool operator<(const PageRegion& Other) const {
-		SPMR_DEBUG(std::cout << "Runtime: (" << Start << ", " << End << ") < ("
-							 << Other.Start << ", " << Other.End << ") == "
-							 << (Start < Other.Start ? End < Other.End : false) << "\n");
-      return Start < Other.Start ? End < Other.End : false;
-    }
-  };
+//uint64_t count;
 
-public:
-  typedef std::map<PageRegion, pid_t> RegionsTy;
+/* ***************************************************************** */
+/* ***************************************************************** */
 
-  RegionsTy::iterator insert(long Start, long End, pid_t Idx);
-  RegionsTy::iterator begin() { return Regions_.begin(); }
-  RegionsTy::iterator end()   { return Regions_.end();   }
+//options read from the SPM_CONFIG file; the environment takes precedence
+static std::map<std::string, std::string> __spm_config;
 
-private:
-  RegionsTy::iterator join(RegionsTy::iterator L);
-  RegionsTy::iterator join(RegionsTy::iterator L, RegionsTy::iterator R);
 
-  RegionsTy Regions_;
-};
-*/
+// Loads NAME=value lines from the file named by SPM_CONFIG. A "%h" in the
+//name is replaced by the host name, so one setting can point every host to
+//its own file.
+static void loadConfig() {
+	const char *Path = getenv("SPM_CONFIG");
+	if (Path == NULL || *Path == 0)
+		return;
 
-/*
-PageIntervals::RegionsTy::iterator PageIntervals::insert(long Start, long End,
-                                                         pid_t Idx) {
-  SPMR_DEBUG(std::cout << "Runtime: inserting region (" << Start << ", "
-                       << End << ")\n");
-  PageRegion R = { Start, End };
-  auto It = Regions_.insert(std::make_pair(R, Idx));
-  if (It.second) {
-    // Region was inserted - attempt to join it with its neighbors.
-    auto RIt = join(It.first);
-    SPMR_DEBUG(std::cout << "Runtime: iterator for region (" << Start << ", "
-                         << End << ") is (" << RIt->first.Start << ", "
-                         << RIt->first.End << ")\n");
-    return RIt;
-  } else {
-    // Not inserted - an iterator already exists for this region.
-    SPMR_DEBUG(std::cout << "Runtime: iterator already exists for region ("
-                         << Start << ", " << End << ")\n");
-    return end();
-  }
+	std::string Name(Path);
+	size_t Pos = Name.find("%h");
+	if (Pos != std::string::npos) {
+		char Host[256] = {0};
+		gethostname(Host, sizeof(Host) - 1);
+		Name.replace(Pos, 2, Host);
+	}
+
+	std::ifstream File(Name.c_str());
+	if (!File) {
+		fprintf(stderr, "SPM runtime: could not read config file %s\n", Name.c_str());
+		return;
+	}
+
+	std::string Line;
+	while ( std::getline(File, Line) ) {
+		Line = Line.substr(0, Line.find('#'));
+
+		size_t Eq = Line.find('=');
+		if (Eq == std::string::npos)
+			continue;
+
+		std::string Key = Line.substr(0, Eq), Val = Line.substr(Eq + 1);
+		Key.erase(0, Key.find_first_not_of(" \t"));
+		Key.erase(Key.find_last_not_of(" \t\r") + 1);
+		Val.erase(0, Val.find_first_not_of(" \t"));
+		Val.erase(Val.find_last_not_of(" \t\r") + 1);
+
+		if ( !Key.empty() )
+			__spm_config[Key] = Val;
+	}
+
+	SPMR_DEBUG(std::cout << "Runtime: read " << __spm_config.size()
+					   << " options from " << Name << "\n");
 }
 
-*/
 
-/*
-PageIntervals::RegionsTy::iterator PageIntervals::join(RegionsTy::iterator L) {
-  RegionsTy::iterator It = L; ++It;
-  // Join with the greater (>) subtree.
-  if (It != Regions_.end()) {
-    L = join(L, It);
-  }
-  // Join with the lesser (<) subtree.
-  if (L != Regions_.begin()) {
-    RegionsTy::iterator It = L; --It;
-    L = join(L, It);
-  }
-  return L;
+// Reads a runtime option from the environment or the config file.
+static const char *getStringOption(const char *Name, const char *Default) {
+	const char *Str = getenv(Name);
+	if (Str != NULL && *Str != 0)
+		return Str;
+
+	std::map<std::string, std::string>::iterator It = __spm_config.find(Name);
+	if ( It != __spm_config.end() && !It->second.empty() )
+		return It->second.c_str();
+
+	return Default;
 }
 
-*/
 
-/*
-PageIntervals::RegionsTy::iterator PageIntervals::join(RegionsTy::iterator L,
-                                                      RegionsTy::iterator R) {
-  // TODO: try to lease a single conflicting page to multiple threads - it
-  // could be an array boundary.
-  if (L->second != R->second) {
-    SPMR_DEBUG(std::cout << "Runtime: region conflicts with other thread: ("
-                         << L->first.Start << ", " << L->first.End << ") and ("
-                         << R->first.Start << ", " << R->first.End << ")\n");
-    return L;
-  }
-  //
-  // L |---- ---- ---- ----|
-  // R           |---- ---- ---- ----|
-  //
-  if (L->first.Start <= R->first.Start && L->first.End <= R->first.End) {
-    long Start = L->first.Start, End = R->first.End, Idx = L->second;
-    Regions_.erase(L);
-    Regions_.erase(R);
-    return insert(Start, End, Idx);
-  }
-   //
-   // L           |---- ---- ---- ----|
-   // R |---- ---- ---- ----|
-   //
-  if (R->first.Start <= L->first.Start && R->first.End <= L->first.End) {
-    long Start = R->first.Start, End = L->first.End, Idx = L->second;
-    Regions_.erase(R);
-    Regions_.erase(L);
-    return insert(Start, End, Idx);
-  }
-   //
-   // L      |---- ----|
-   // R |---- ---- ---- ----|
-   //
-  if (L->first.Start >= R->first.Start && L->first.End <= R->first.End) {
-    Regions_.erase(L);
-    return R;
-  }
-   //
-   // L |---- ---- ---- ----|
-   // R      |---- ----|
-   //
-  if (R->first.Start >= L->first.Start && R->first.End <= L->first.End) {
-    Regions_.erase(R);
-    return L;
-  }
-  //
-  // L |---- ---- ---- ----|
-  // R                         |---- ---- ---- ----|
-  //
-  assert(L->first.End < R->first.Start || L->first.Start > R->first.End ||
-         L->second != R->second);
-  return L;
+static long getOption(const char *Name, long Default) {
+	const char *Str = getStringOption(Name, NULL);
+	if (Str == NULL)
+		return Default;
+
+	char *End;
+	long Val = strtol(Str, &End, 0);
+	return (*End == 0) ? Val : Default;
 }
-*/
 
-//static PageIntervals SPMPI;
-//static std::mutex    SPMPILock;
 
-//uint64_t count;
+static double getFloatOption(const char *Name, double Default) {
+	const char *Str = getStringOption(Name, NULL);
+	if (Str == NULL)
+		return Default;
 
-void migrate(long PageStart, long PageEnd) {
-	SPMR_DEBUG(std::cout << "Runtime: migrate pages: " << PageStart << " to "
-					   << PageEnd << "\n");
-	SPMR_DEBUG(std::cout << "Runtime: hwloc call: " << (PageStart << PAGE_EXP)
-					   << ", " << ((PageEnd - PageStart) << PAGE_EXP) << "\n");
+	char *End;
+	double Val = strtod(Str, &End);
+	return (*End == 0) ? Val : Default;
+}
 
+// Returns the logical index (into __spm_nodes) of the node the calling
+//thread last ran on, asking hwloc. Only used when sched_getcpu() can't tell.
+static int lookupNode() {
 	hwloc_bitmap_t set = hwloc_bitmap_alloc();
 
-	hwloc_get_cpubind(__spm_topo, set, HWLOC_CPUBIND_THREAD);
 	hwloc_get_last_cpu_location(__spm_topo, set, HWLOC_CPUBIND_THREAD);
-
 	hwloc_bitmap_singlify(set);
 
-/*
-	hwloc_nodeset_t nodeset = hwloc_bitmap_alloc();
+	int Node = 0;
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		if ( hwloc_bitmap_intersects(set, __spm_node_cpusets[i]) ) {
+			Node = i;
+			break;
+		}
+	}
 
-	hwloc_cpuset_to_nodeset(__spm_topo, set, nodeset);
+	hwloc_bitmap_free(set);
+	return Node;
+}
 
-	char set_str[15] = {0};
-	hwloc_bitmap_snprintf(set_str,14,(hwloc_const_bitmap_t)nodeset);
 
-	uint64_t set_num = strtoull(set_str,NULL,16);
-	int nto=-1, nfrom=-1;
+static void setContextNode(ThreadContext &Ctx, int Node) {
+	Ctx.Node = Node;
+	Ctx.Cpuset = __spm_node_cpusets[Node];
+	Ctx.Nodeset = __spm_nodes[Node];
+}
 
-	for (nfrom=0; set_num != 1; ++nfrom) //log2
-		set_num >>= 1;
 
-	//nfrom %= 8;
+static ThreadContext &threadContext() {
+	ThreadContext &Ctx = __spm_context;
+	int Cpu = sched_getcpu();
 
-	long remainder = (long)( (PageStart << PAGE_EXP) & (PAGE_SIZE-1) );
-	long page = (long)( (PageStart << PAGE_EXP) - remainder );
-	long len = (PageEnd - PageStart) + remainder;
-*/
-	assert(
-			hwloc_set_area_membind(__spm_topo, (const void*)(PageStart << PAGE_EXP),
-								  (PageEnd - PageStart) << PAGE_EXP,
-								  (hwloc_const_cpuset_t)set, HWLOC_MEMBIND_BIND,
-								  HWLOC_MEMBIND_MIGRATE)
-	!= -1 && "Unable to migrate requested pages");
-/*
-SPMPILock.lock();
-	count++;
-SPMPILock.unlock();
-*/
+	if (Cpu == Ctx.Cpu && Ctx.Node >= 0)
+		return Ctx;
 
+	SPMR_DEBUG(std::cout << "Runtime: thread moved from CPU " << Ctx.Cpu
+					   << " to " << Cpu << "\n");
 
-/*
-	for (long j=0; j<len; ++j) {
-		get_mempolicy(&nto, NULL, 0, (void*)(page+j), MPOL_F_NODE | MPOL_F_ADDR);
-		SPMPILock.lock();
-			add_page_to_set(page+j,&page_log,nfrom,nto);
-		SPMPILock.unlock();
-	}
+	Ctx.Cpu = Cpu;
+	if (Cpu >= 0 && Cpu < __spm_num_cpus && __spm_cpu_node[Cpu] >= 0)
+		setContextNode(Ctx, __spm_cpu_node[Cpu]);
+	else
+		setContextNode(Ctx, lookupNode());
 
-	hwloc_bitmap_free(nodeset);
-*/
-	hwloc_bitmap_free(set);
+	return Ctx;
 }
 
 
-void __spm_init() {
-  SPMR_DEBUG(std::cout << "Runtime: initialize\n");
+// Returns the logical index (into __spm_nodes) of the node the calling
+//thread runs on.
+static inline int currentNode() {
+	return threadContext().Node;
+}
 
-  hwloc_topology_init(&__spm_topo);
-  hwloc_topology_load(__spm_topo);
 
-  hwloc_obj_t obj;
-  for (obj = hwloc_get_obj_by_type(__spm_topo, HWLOC_OBJ_PU, 0); obj;
-       obj = obj->parent)
-    if (obj->type == HWLOC_OBJ_CACHE)
-      __spm_cache_size += obj->attr->cache.size;
+// Maps a node OS index (as used by move_pages) back to its logical index.
+static int nodeFromOsIndex(int OsIndex) {
+	for (int i=0; i<__spm_num_nodes; ++i)
+		if (__spm_node_os_index[i] == OsIndex)
+			return i;
+	return -1;
+}
 
-	__spm_full_cpuset = hwloc_bitmap_alloc();
-	hwloc_get_cpubind(__spm_topo, __spm_full_cpuset, HWLOC_CPUBIND_PROCESS);
 
-////////////////////////////////////////////////////////////////////////
-	__spm_num_nodes = hwloc_get_nbobjs_by_type (__spm_topo, HWLOC_OBJ_NODE);
-	__spm_current_node = -1;
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+// Shadow map with the node of every page the runtime has migrated or
+//queried, 4 bits per page. It lets __spm_get see that a range is already
+//local without entering the kernel.
+//
+// The address space is split in chunks of CHUNK_PAGES pages; the shadow
+//words of a chunk are allocated the first time one of its pages is
+//recorded and never freed, so lookups need no locking.
+class ResidencyMap {
+public:
+	static const int  BITS        = 4;
+	static const int  PER_WORD    = 64 / BITS;
+	static const long CHUNK_PAGES = 1 << 15;
+	static const long CHUNK_WORDS = CHUNK_PAGES / PER_WORD;
+	static const uint64_t UNKNOWN = (1 << BITS) - 1;
+	static const uint64_t ONES    = 0x1111111111111111UL; //one per nibble
+
+	ResidencyMap() {
+		for (int i=0; i<SHADOW_CHUNKS; ++i) {
+			Table_[i].Key.store(0, std::memory_order_relaxed);
+			Table_[i].Words.store(NULL, std::memory_order_relaxed);
+		}
+	}
 
+	// True if every page in [PageStart, PageEnd) is known to be on Node.
+	bool isLocal(long PageStart, long PageEnd, int Node) {
+		if ((uint64_t)Node >= UNKNOWN)
+			return false;
 
-	__spm_nodes = (hwloc_bitmap_t*)malloc(__spm_num_nodes*sizeof(hwloc_bitmap_t));
-	if (__spm_nodes == NULL) {
-		printf("\nOOOOOPPPSSSSSS....\n");
-		exit(99);
+		const uint64_t Pattern = ONES * Node;
+
+		for (long P = PageStart; P < PageEnd; ) {
+			long Chunk = P / CHUNK_PAGES;
+			long Last = std::min(PageEnd, (Chunk + 1) * CHUNK_PAGES);
+
+			std::atomic<uint64_t> *Words = getChunk(Chunk, false);
+			if (Words == NULL)
+				return false;
+
+			//word-at-a-time: 16 pages per comparison
+			for (long Q = P; Q < Last; ) {
+				long Idx = (Q % CHUNK_PAGES) / PER_WORD;
+				int First = Q % PER_WORD;
+				int Count = (int)std::min<long>(PER_WORD - First, Last - Q);
+				uint64_t Mask = mask(First, Count);
+
+				if ( ((Words[Idx].load(std::memory_order_relaxed) ^ Pattern) & Mask) != 0 )
+					return false;
+
+				Q += Count;
+			}
+
+			P = Last;
+		}
+
+		return true;
 	}
 
-	for (int i=0; i<__spm_num_nodes; ++i) {
-		obj = hwloc_get_obj_by_type (__spm_topo, HWLOC_OBJ_NODE, i);
-		__spm_nodes[i] = hwloc_bitmap_alloc();
-		hwloc_bitmap_copy(__spm_nodes[i], obj->nodeset);
+	// Records that every page in [PageStart, PageEnd) is on Node.
+	void set(long PageStart, long PageEnd, int Node) {
+		uint64_t Value = (Node >= 0 && (uint64_t)Node < UNKNOWN) ? Node : UNKNOWN;
+		const uint64_t Pattern = ONES * Value;
+
+		for (long P = PageStart; P < PageEnd; ) {
+			long Chunk = P / CHUNK_PAGES;
+			long Last = std::min(PageEnd, (Chunk + 1) * CHUNK_PAGES);
+
+			std::atomic<uint64_t> *Words = getChunk(Chunk, Value != UNKNOWN);
+			if (Words == NULL) {
+				if (Value != UNKNOWN)
+					return; //table full, pages stay unknown
+				P = Last;   //nothing recorded for the chunk
+				continue;
+			}
+
+			for (long Q = P; Q < Last; ) {
+				long Idx = (Q % CHUNK_PAGES) / PER_WORD;
+				int First = Q % PER_WORD;
+				int Count = (int)std::min<long>(PER_WORD - First, Last - Q);
+
+				if (Count == PER_WORD) {
+					Words[Idx].store(Pattern, std::memory_order_relaxed);
+				}
+				else {
+					uint64_t Mask = mask(First, Count);
+					uint64_t Old = Words[Idx].load(std::memory_order_relaxed);
+					while ( !Words[Idx].compare_exchange_weak(Old, (Old & ~Mask) | (Pattern & Mask), std::memory_order_relaxed) );
+				}
+
+				Q += Count;
+			}
+
+			P = Last;
+		}
+	}
+
+	// Forgets where the pages in [PageStart, PageEnd) are, e.g. once they
+	//are unmapped, so that memory mapped there later is not taken as local.
+	void forget(long PageStart, long PageEnd) {
+		set(PageStart, PageEnd, -1);
+	}
+
+private:
+	static uint64_t mask(int First, int Count) {
+		uint64_t Bits = (Count == PER_WORD) ? ~0UL : ((1UL << (Count*BITS)) - 1);
+		return Bits << (First*BITS);
+	}
+
+	// Open-addressing table of chunks; entries are only ever added.
+	std::atomic<uint64_t> *getChunk(long Chunk, bool Create) {
+		long Key = Chunk + 1;
+		unsigned long Hash = ((unsigned long)Chunk * 0x9E3779B97F4A7C15UL) >> 32;
+
+		for (int Probe = 0; Probe < SHADOW_CHUNKS; ++Probe) {
+			Slot &S = Table_[(Hash + Probe) % SHADOW_CHUNKS];
+			long Cur = S.Key.load(std::memory_order_acquire);
+
+			if (Cur == 0) {
+				if (!Create)
+					return NULL;
+
+				std::atomic<uint64_t> *Words = new std::atomic<uint64_t>[CHUNK_WORDS];
+				for (long i=0; i<CHUNK_WORDS; ++i)
+					Words[i].store(~0UL, std::memory_order_relaxed); //all unknown
+
+				if ( S.Key.compare_exchange_strong(Cur, Key, std::memory_order_acq_rel) ) {
+					S.Words.store(Words, std::memory_order_release);
+					return Words;
+				}
+
+				delete[] Words; //lost the race, Cur now holds the winner's key
+			}
+
+			if (Cur == Key) {
+				std::atomic<uint64_t> *Words;
+				while ( (Words = S.Words.load(std::memory_order_acquire)) == NULL )
+					sched_yield(); //being published by another thread
+				return Words;
+			}
+		}
+
+		return NULL;
+	}
+
+	struct Slot {
+		std::atomic<long> Key; //chunk + 1, 0 if empty
+		std::atomic<std::atomic<uint64_t>*> Words;
+	};
+
+	Slot Table_[SHADOW_CHUNKS];
+};
+
+bool __spm_shadow = true;
+long __spm_shadow_validate = 0;
+std::atomic<long> __spm_shadow_checks(0);
+std::atomic<long> __spm_shadow_drift(0);
+static ResidencyMap SPMRM;
+
+
+// Cross-checks the shadow map against the kernel on a few pages spread over
+//the range. Pages found elsewhere are corrected in the map.
+static bool validateResidency(long PageStart, long PageEnd, int Node) {
+	const int SAMPLES = 8;
+	void *Pages[SAMPLES];
+	int PageStatus[SAMPLES];
+
+	long Stride = std::max(1L, (PageEnd - PageStart) / SAMPLES);
+	int N = 0;
+	for (long P = PageStart; P < PageEnd && N < SAMPLES; P += Stride)
+		Pages[N++] = (void*)(P << __spm_page_exp);
+
+	if ( move_pages(0, N, Pages, NULL, PageStatus, 0) != 0 )
+		return true;
+
+	bool Valid = true;
+	for (int i=0; i<N; ++i) {
+		if (PageStatus[i] < 0 || PageStatus[i] == __spm_node_os_index[Node])
+			continue;
+
+		long Page = (long)Pages[i] >> __spm_page_exp;
+		SPMRM.set(Page, Page + 1, nodeFromOsIndex(PageStatus[i]));
+		Valid = false;
 	}
+
+	if (!Valid) {
+		++__spm_shadow_drift;
+		SPMR_DEBUG(std::cout << "Runtime: shadow map drift in pages " << PageStart
+						   << " to " << PageEnd << "\n");
+	}
+
+	return Valid;
 }
 
 
-void __spm_end() {
-	SPMR_DEBUG(std::cout << "Runtime: end\n");
-	//printf("\n\ncount=%lu\n",count);
+/* ***************************************************************** */
+/* ***************************************************************** */
 
-	hwloc_bitmap_free(__spm_full_cpuset);
+// Monotonic clock, in microseconds.
+static long now() {
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec*1000000L + Ts.tv_nsec/1000;
+}
 
-	for (int i=0; i<__spm_num_nodes; ++i)
-		hwloc_bitmap_free(__spm_nodes[i]);
-	free(__spm_nodes);
 
-	hwloc_topology_destroy(__spm_topo);
-/*
-	print_log(&page_log);
-	clear_map(&page_log);
-*/
+// Monotonic clock, in nanoseconds.
+static long nowNs() {
+	struct timespec Ts;
+	clock_gettime(CLOCK_MONOTONIC, &Ts);
+	return Ts.tv_sec*1000000000L + Ts.tv_nsec;
 }
 
 
-void __spm_thread_lock() {
-/*
-	char last_node[100];
-*/
+//call-site metadata; the pass emits one table per module with this layout
+//and registers it through __spm_register_sites
+struct SiteInfo {
+	long Id;
+	const char *Function;
+	const char *Loop;  //name of the loop header block
+	const char *File;  //empty without debug info
+	int Line;
+	int Direction;     //1 or -1 if the loop walks the range up or down, 0 if unknown
+	const char *Array;
+};
 
-	hwloc_bitmap_t _cpuset_ = hwloc_bitmap_alloc();
-/*
-	hwloc_get_cpubind(__spm_topo, _cpuset_, HWLOC_CPUBIND_THREAD);
-	hwloc_get_last_cpu_location(__spm_topo, _cpuset_, HWLOC_CPUBIND_THREAD);
+// Counters of one __spm_get call site.
+struct SiteStats {
+	std::atomic<long> Key; //site ID + 1, 0 if the slot is free
+	std::atomic<const SiteInfo*> Info;
+	std::atomic<long> Calls;
+	std::atomic<long> Accepted; //heuristic chose to migrate
+	std::atomic<long> Rejected;
+	std::atomic<long> Bytes;    //bytes actually moved
+	std::atomic<long> KernelNs; //time spent migrating
+
+	//adaptive mode: from loop execution ProbeStart on, each thread alternates
+	//its executions without and with migration until both modes have samples
+	//executions; their mean times decide whether the site migrates until the
+	//next probe
+	std::atomic<long> Runs;
+	std::atomic<long> ProbeStart;
+	std::atomic<long> Samples, OnNs, OnRuns, OffNs, OffRuns;
+	std::atomic<int> Backoff;   //the next probe is period << Backoff runs away
+	std::atomic<bool> Disabled;
+	std::atomic<long> Probes;   //decisions taken
+	std::atomic<long> Skipped;  //accepted, but the site was disabled
+
+	std::atomic<long> ThreadMoves; //thread moved to the data instead
+
+	std::atomic<bool> Remap; //listed in SPM_REMAP_SITES
+};
 
-	hwloc_bitmap_singlify(_cpuset_);
+// Open-addressing table of call sites; entries are only ever added, so the
+//hot path needs no locking. It has no constructor on purpose: being
+//zero-initialized, it may be filled by the module constructors that
+//register the sites before the runtime's own static objects exist.
+class SiteTable {
+public:
+	// Finds or adds the slot of site Id, NULL if the table is full.
+	SiteStats *get(long Id) {
+		long Key = Id + 1;
+		unsigned long Hash = ((unsigned long)Id * 0x9E3779B97F4A7C15UL) >> 32;
 
-	hwloc_nodeset_t _nodeset_ = hwloc_bitmap_alloc();
+		for (int Probe = 0; Probe < SITE_SLOTS; ++Probe) {
+			SiteStats &S = Table_[(Hash + Probe) % SITE_SLOTS];
+			long Cur = S.Key.load(std::memory_order_acquire);
 
-	hwloc_cpuset_to_nodeset(__spm_topo, _cpuset_, _nodeset_); //from the cpuset with a single CPU, we get the node
+			if (Cur == 0 && S.Key.compare_exchange_strong(Cur, Key, std::memory_order_acq_rel))
+				return &S;
 
-	hwloc_cpuset_from_nodeset(__spm_topo, _cpuset_, _nodeset_);//from the node, we get all CPUs on that node
-*/
+			if (Cur == Key)
+				return &S;
+		}
+
+		return NULL;
+	}
+
+	void describe(const SiteInfo *Sites, long NumSites) {
+		for (long i=0; i<NumSites; ++i)
+			if (SiteStats *S = get(Sites[i].Id))
+				S->Info.store(&Sites[i], std::memory_order_release);
+	}
+
+	template<typename Fn> void forEach(Fn F) {
+		for (int i=0; i<SITE_SLOTS; ++i)
+			if (Table_[i].Key.load(std::memory_order_acquire) != 0)
+				F(Table_[i]);
+	}
+
+private:
+	SiteStats Table_[SITE_SLOTS];
+};
 
-	int k;
-	__spm_lock.lock();
-		__spm_current_node = (__spm_current_node + 1)%__spm_num_nodes;
-		k = __spm_current_node;
-	__spm_lock.unlock();
+static SiteTable SPMST;
 
-	hwloc_cpuset_from_nodeset(__spm_topo, _cpuset_, __spm_nodes[k]); //from one node, we get all CPUs on that
+bool __spm_adaptive = false;
+long __spm_adaptive_samples = ADAPTIVE_SAMPLES; //per mode, per probe
+long __spm_adaptive_period = ADAPTIVE_PERIOD;   //runs between probes
+double __spm_adaptive_margin = 0.05;
 
-	hwloc_set_thread_cpubind(__spm_topo, (hwloc_thread_t)pthread_self(), (hwloc_const_cpuset_t)_cpuset_, HWLOC_CPUBIND_THREAD);
 
-/*
-	hwloc_bitmap_snprintf(last_node, 100, /*_nodeset_*/__spm_nodes[k]);
-	//printf("\n[tid=%08x] node=%s\n",pthread_self(),last_node);
-*/
+// Ends the probe that started at run Probe, unless another thread already
+//did, and schedules the next one.
+static bool closeProbe(SiteStats *Site, long Probe, int Backoff) {
+	if ( !Site->ProbeStart.compare_exchange_strong(Probe, Site->Runs + (__spm_adaptive_period << Backoff)) )
+		return false;
 
-	hwloc_bitmap_free(_cpuset_);
-	//hwloc_bitmap_free(_nodeset_);
+	Site->Backoff = Backoff;
+	Site->OnNs = Site->OnRuns = Site->OffNs = Site->OffRuns = 0;
+	Site->Samples = 0;
+	++Site->Probes;
+	return true;
 }
 
+// Adds a probe sample to the site; the sample that completes the probe
+//decides whether migrating pays off and when to probe again. A site that
+//keeps showing no benefit is probed less and less often.
+static void recordProbe(SiteStats *Site, long Probe, bool Migrate, long Ns) {
+	if (Site->ProbeStart.load() != Probe)
+		return; //already decided
 
-void __spm_thread_unlock() {
+	if (Migrate) {
+		Site->OnNs   += Ns;
+		Site->OnRuns += 1;
+	}
+	else {
+		Site->OffNs   += Ns;
+		Site->OffRuns += 1;
+	}
 
-	hwloc_set_thread_cpubind(__spm_topo, (hwloc_thread_t)pthread_self(), (hwloc_const_cpuset_t)__spm_full_cpuset, HWLOC_CPUBIND_THREAD);
+	if (Site->OnRuns < __spm_adaptive_samples || Site->OffRuns < __spm_adaptive_samples)
+		return;
+
+	double On  = (double)Site->OnNs / Site->OnRuns;
+	double Off = (double)Site->OffNs / Site->OffRuns;
+	bool Helps = On < Off * (1 - __spm_adaptive_margin);
+
+	if ( !closeProbe(Site, Probe, Helps ? 0 : std::min(Site->Backoff.load() + 1, 6)) )
+		return;
+
+	Site->Disabled = !Helps;
+
+	SPMR_DEBUG(std::cout << "Runtime: site " << Site->Key - 1 << ": " << On << " ns with migration, "
+					   << Off << " ns without, " << (Helps ? "enabled" : "disabled") << "\n");
 }
 
 
-void __spm_get(void *Ary, long Start, long End, long Reuse) {
+// Index of the calling thread's execution of the site's loop within probe
+//Probe. Each thread alternates its own executions, so which of them migrate
+//does not depend on how the threads interleave, and starts without migration,
+//so its first sample is taken before its own ranges were moved.
+static long probeRun(SiteStats *Site, long Probe) {
+	std::vector<ProbeCursor> &Cursors = __spm_context.Probes;
 
-	SPMR_DEBUG(std::cout << "Runtime: get page for: " << (long unsigned)Ary
-		<< ", " << Start << ", " << End << ", "
-		<< Reuse << "\n");
+	for (size_t i=0; i<Cursors.size(); ++i) {
+		if (Cursors[i].Site != Site)
+			continue;
 
-	long PageStart = ((long)Ary + Start)/PAGE_SIZE;
-	long PageEnd   = ((long)Ary + End)/PAGE_SIZE;
+		if (Cursors[i].ProbeStart != Probe) {
+			Cursors[i].ProbeStart = Probe;
+			Cursors[i].Runs = 0;
+		}
+		return Cursors[i].Runs++;
+	}
 
+	ProbeCursor C = { Site, Probe, 1 };
+	Cursors.push_back(C);
+	return 0;
+}
 
-	//printf("\n\nReuse=%ld, Start=%ld, End=%ld",Reuse,PageStart,PageEnd);
 
-	if ( (double)(End-Start) > __spm_CacheConstant*__spm_cache_size && (double)Reuse/(End-Start > 0 ? End-Start : 100000) > __spm_ReuseConstant ) { //heuristic
+// The innermost execution of the site's loop being timed, NULL if none.
+static LoopTimer *loopTimer(SiteStats *Site) {
+	std::vector<LoopTimer> &Timers = __spm_context.Timers;
 
-		//printf("\n\nExpr=%lf",(double)Reuse/(double)( (PageEnd - PageStart) * PAGE_SIZE ));
-		//printf("\n\nExpr=%lu",(End-Start));
-		//printf("\nMIGROU\n");
-/*
-		SPMR_DEBUG(std::cout << "Runtime: get pages: " << PageStart << ", "
-			<< PageEnd << "\n");
+	for (size_t i = Timers.size(); i-- > 0; )
+		if (Timers[i].Site == Site)
+			return &Timers[i];
 
-		pid_t Idx = syscall(SYS_gettid);
+	return NULL;
+}
 
-		SPMPILock.lock();
-		auto It = SPMPI.insert(PageStart, PageEnd, Idx);
 
-		if (It == SPMPI.end()) {
-			SPMPILock.unlock();
-			return;
+// Whether __spm_get may migrate for the site in the current execution of its
+//loop.
+static bool migrationAllowed(SiteStats *Site) {
+	if (LoopTimer *T = loopTimer(Site))
+		return T->Migrate;
+
+	return !Site->Disabled.load(std::memory_order_relaxed);
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//transparent huge pages: ranges backed by huge pages are migrated in whole
+//huge pages (SPM_THP, on by default)
+bool __spm_thp = true;
+bool __spm_madvise_huge = false;
+long __spm_hpage_size = 2L << 20;
+long __spm_smaps_refresh = SMAPS_REFRESH_US;
+
+
+// Page size backing each mapping of the process, read from /proc/self/smaps.
+//Parsing it is expensive, so the table is only rebuilt when it is older
+//than __spm_smaps_refresh, or on a lookup miss at most every 10 ms; one
+//thread rebuilds it while the others keep using the old one.
+class MappingCache {
+public:
+	struct Mapping {
+		long Start, End; //bytes
+		long PageSize;   //of every page: hugetlbfs mappings only
+		bool Thp;        //some pages are transparent huge pages
+		bool Remappable; //private, anonymous and read-write
+	};
+
+	MappingCache() : Stamp_(0) {
+		pthread_rwlock_init(&Lock_, NULL);
+	}
+
+	// Finds the mapping holding Addr; false if there is none (yet).
+	bool lookup(long Addr, Mapping &M) {
+		long Now = now();
+		bool Found = find(Addr, M);
+		long Age = Now - Stamp_.load(std::memory_order_relaxed);
+
+		if ( (Age > __spm_smaps_refresh || (!Found && Age > 10000)) && refresh(Now) )
+			Found = find(Addr, M);
+
+		return Found;
+	}
+
+private:
+	bool find(long Addr, Mapping &M) {
+		bool Found = false;
+
+		pthread_rwlock_rdlock(&Lock_);
+		auto It = std::upper_bound(Maps_.begin(), Maps_.end(), Addr,
+			[](long A, const Mapping &Map) { return A < Map.End; });
+		if (It != Maps_.end() && It->Start <= Addr) {
+			M = *It;
+			Found = true;
 		}
-		SPMPILock.unlock();
+		pthread_rwlock_unlock(&Lock_);
 
-		SPMR_DEBUG(std::cout << "Runtime: thread #" << Idx
-			<< " now holds pages (possibly amongst others): "
-			<< It->first.Start << " to " << It->first.End << "\n");
-*/
+		return Found;
+	}
 
-//printf("\nstart: %ld,  end: %ld",PageStart,PageEnd); //test which pages are being migrated
-//printf("\nTo be migrated: %p\n",Ary);
-		return (void) migrate(PageStart, PageEnd);
+	bool refresh(long Now) {
+		if ( pthread_rwlock_trywrlock(&Lock_) != 0 )
+			return false;
+
+		Maps_.clear();
+
+		std::ifstream File("/proc/self/smaps");
+		std::string Line;
+		Mapping M = { 0, 0, 0, false, false };
+		long Kernel = 0, Huge = 0;
+
+		while ( std::getline(File, Line) ) {
+			unsigned long Start, End, Inode = 0;
+			char Perms[5] = {0};
+			int Name = 0;
+			long Value;
+
+			if ( sscanf(Line.c_str(), "%lx-%lx %4s %*x %*s %lu %n", &Start, &End, Perms, &Inode, &Name) == 4 ) {
+				if (M.End > 0)
+					add(M, Kernel, Huge);
+				M.Start = Start;
+				M.End = End;
+				//named anonymous mappings ([heap], [stack], ...) are left alone
+				M.Remappable = !strcmp(Perms, "rw-p") && Inode == 0
+					&& (Name == 0 || Line.find_first_not_of(" \t", Name) == std::string::npos);
+				Kernel = Huge = 0;
+			}
+			else if ( sscanf(Line.c_str(), "KernelPageSize: %ld kB", &Value) == 1 )
+				Kernel = Value << 10;
+			else if ( sscanf(Line.c_str(), "AnonHugePages: %ld kB", &Value) == 1 )
+				Huge = Value << 10;
+		}
+		if (M.End > 0)
+			add(M, Kernel, Huge);
+
+		Stamp_.store(Now, std::memory_order_relaxed);
+		pthread_rwlock_unlock(&Lock_);
+		return true;
+	}
+
+	//hugetlbfs mappings report their page size; THP-backed ones report the
+	//base size and have AnonHugePages, which says nothing of which of their
+	//pages are huge, so they keep the base size
+	void add(Mapping M, long Kernel, long Huge) {
+		M.PageSize = std::max(Kernel, __spm_page_size);
+		M.Thp = Huge > 0;
+		Maps_.push_back(M);
+	}
+
+	pthread_rwlock_t Lock_;
+	std::vector<Mapping> Maps_; //sorted, as in smaps
+	std::atomic<long> Stamp_;
+};
+
+static MappingCache SPMMC;
+
+
+// Splits [PageStart, PageEnd) into a body and the pages left before and
+//after it. In a hugetlbfs mapping the body is widened to whole huge pages as
+//far as the mapping allows, and the base pages per huge page are returned.
+//Otherwise 1 is returned; in a mapping with transparent huge pages the body
+//shrinks to the huge page boundaries inside the range, so binding it does
+//not split the mapping or its huge pages, and BaseEnds tells the caller to
+//move the pages before and after it one by one. Transparent huge pages may
+//sit next to base pages anywhere, so the body is still counted page by page.
+static long hugePageBody(long PageStart, long PageEnd, long &BodyStart, long &BodyEnd, bool &BaseEnds) {
+	BodyStart = PageStart;
+	BodyEnd = PageEnd;
+	BaseEnds = false;
+
+	MappingCache::Mapping M;
+	if ( !__spm_thp || !SPMMC.lookup(PageStart << __spm_page_exp, M) )
+		return 1;
+
+	if (M.PageSize <= __spm_page_size) {
+		if (M.Thp) {
+			long Huge = __spm_hpage_size >> __spm_page_exp;
+			BodyStart = std::min(PageEnd, (PageStart + Huge - 1) / Huge * Huge);
+			BodyEnd = std::max(BodyStart, PageEnd / Huge * Huge);
+			BaseEnds = true;
+		}
+		return 1;
+	}
+
+	long Step = M.PageSize >> __spm_page_exp;
+	long First = M.Start >> __spm_page_exp, Last = M.End >> __spm_page_exp;
+
+	long S = PageStart / Step * Step;
+	if (S < First)
+		S += Step;
+
+	long E = (PageEnd + Step - 1) / Step * Step;
+	if (E > Last)
+		E = Last / Step * Step;
+
+	if (S >= E)
+		return 1;
+
+	BodyStart = S;
+	BodyEnd = E;
+	return Step;
+}
+
+
+// Asks for huge pages on the whole huge pages inside the range.
+static void adviseHugePages(long PageStart, long PageEnd) {
+	long Step = __spm_hpage_size >> __spm_page_exp;
+	long S = (PageStart + Step - 1) / Step * Step;
+	long E = PageEnd / Step * Step;
+
+	if (S < E)
+		madvise((void*)(S << __spm_page_exp), (E - S) << __spm_page_exp, MADV_HUGEPAGE);
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//migration failures: busy pages are retried __spm_retries times with
+//exponential backoff, nodes outside mems_allowed are replaced by the
+//nearest allowed one, and every error is counted by errno
+const int ERRNO_SLOTS = 256;
+std::atomic<long> __spm_errors[ERRNO_SLOTS];
+std::atomic<long> __spm_retried(0);
+std::atomic<long> __spm_fallbacks(0);
+
+long __spm_retries = RETRIES;
+long __spm_retry_us = RETRY_US;
+
+bool* __spm_node_allowed;
+double* __spm_distances; //__spm_num_nodes x __spm_num_nodes, NULL if unknown
+
+
+static void countError(int Err) {
+	if (Err > 0 && Err < ERRNO_SLOTS)
+		++__spm_errors[Err];
+}
+
+
+static bool isTransient(int Err) {
+	return Err == EBUSY || Err == EAGAIN || Err == ENOMEM || Err == EIO;
+}
+
+
+static void backoff(int Attempt) {
+	++__spm_retried;
+	usleep(__spm_retry_us << std::min(Attempt, 10));
+}
+
+
+// Reads the nodes the process may allocate on (its cpuset's mems_allowed).
+static void refreshAllowedNodes() {
+	const unsigned long MAX_NODES = 1024;
+	unsigned long Mask[MAX_NODES / (8*sizeof(unsigned long))];
+	int Mode;
+
+	bool Known = get_mempolicy(&Mode, Mask, MAX_NODES, NULL, MPOL_F_MEMS_ALLOWED) == 0;
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		unsigned long Os = __spm_node_os_index[i];
+		const unsigned long Bits = 8*sizeof(unsigned long);
+
+		__spm_node_allowed[i] = !Known || Os >= MAX_NODES || ((Mask[Os / Bits] >> (Os % Bits)) & 1);
+	}
+}
+
+
+// The allowed node closest to Node (Node itself if allowed), by hwloc
+//distance or else by index; -1 if there is none.
+static int nearestAllowedNode(int Node) {
+	if (__spm_node_allowed[Node])
+		return Node;
+
+	int Best = -1;
+	double BestDist = 0;
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		if (!__spm_node_allowed[i])
+			continue;
+
+		double Dist = __spm_distances ? __spm_distances[Node*__spm_num_nodes + i] : std::abs(i - Node);
+		if (Best < 0 || Dist < BestDist) {
+			Best = i;
+			BestDist = Dist;
+		}
+	}
+
+	return Best;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//memory pressure: a monitor thread refreshes the free memory of every node
+//each __spm_free_refresh ms; a migration that would leave its destination
+//with less than __spm_min_free bytes is shrunk, redirected or refused
+//(SPM_PRESSURE)
+enum PressurePolicy {
+	SPM_PRESSURE_SHRINK,   //migrate only what fits above the watermark
+	SPM_PRESSURE_REDIRECT, //to the nearest node with room
+	SPM_PRESSURE_REFUSE
+};
+
+PressurePolicy __spm_pressure = SPM_PRESSURE_SHRINK;
+long __spm_min_free = MIN_FREE_MB << 20;
+long __spm_free_refresh = FREE_REFRESH_MS;
+
+std::atomic<long>* __spm_node_free; //bytes, -1 if unknown
+std::atomic<long> __spm_pressure_shrunk(0);
+std::atomic<long> __spm_pressure_redirected(0);
+std::atomic<long> __spm_pressure_refused(0);
+
+bool __spm_monitor_running = false;
+pthread_t __spm_monitor;
+sem_t __spm_monitor_stop;
+
+
+// Free memory of the node in bytes, from sysfs; -1 if unknown.
+static long nodeFreeMemory(int Node) {
+	char Name[64];
+	snprintf(Name, sizeof(Name), "/sys/devices/system/node/node%d/meminfo", __spm_node_os_index[Node]);
+
+	std::ifstream File(Name);
+	std::string Line;
+	while ( std::getline(File, Line) ) {
+		size_t Pos = Line.find("MemFree:");
+		if (Pos != std::string::npos)
+			return atol(Line.c_str() + Pos + 8) << 10;
+	}
+
+	return -1;
+}
+
+
+static void refreshFreeMemory() {
+	for (int i=0; i<__spm_num_nodes; ++i)
+		__spm_node_free[i].store(nodeFreeMemory(i), std::memory_order_relaxed);
+}
+
+
+static void *memoryMonitor(void *) {
+	for (;;) {
+		struct timespec Deadline;
+		clock_gettime(CLOCK_REALTIME, &Deadline);
+		Deadline.tv_nsec += (__spm_free_refresh % 1000) * 1000000L;
+		Deadline.tv_sec  += __spm_free_refresh / 1000 + Deadline.tv_nsec / 1000000000L;
+		Deadline.tv_nsec %= 1000000000L;
+
+		if ( sem_timedwait(&__spm_monitor_stop, &Deadline) == 0 )
+			break;
+
+		if (errno == ETIMEDOUT)
+			refreshFreeMemory();
+	}
+
+	return NULL;
+}
+
+
+// Checks the migration of [PageStart, PageEnd) to Node against the
+//watermark; may shorten the range or change the node. Returns false if the
+//migration must not happen. Admitted bytes are taken from the node's free
+//memory until the next refresh, so back-to-back migrations add up.
+static bool admitMigration(long PageStart, long &PageEnd, int &Node) {
+	if (__spm_min_free <= 0)
+		return true;
+
+	long Bytes = (PageEnd - PageStart) << __spm_page_exp;
+	long Free = __spm_node_free[Node].load(std::memory_order_relaxed);
+
+	if (Free < 0 || Free - Bytes >= __spm_min_free) {
+		__spm_node_free[Node] -= Bytes;
+		return true;
+	}
+
+	if (__spm_pressure == SPM_PRESSURE_REDIRECT) {
+		int Best = -1;
+		double BestDist = 0;
+
+		for (int i=0; i<__spm_num_nodes; ++i) {
+			long F = __spm_node_free[i].load(std::memory_order_relaxed);
+			if ( i == Node || !__spm_node_allowed[i] || (F >= 0 && F - Bytes < __spm_min_free) )
+				continue;
+
+			double Dist = __spm_distances ? __spm_distances[Node*__spm_num_nodes + i] : std::abs(i - Node);
+			if (Best < 0 || Dist < BestDist) {
+				Best = i;
+				BestDist = Dist;
+			}
+		}
+
+		if (Best >= 0) {
+			SPMR_DEBUG(std::cout << "Runtime: node " << Node << " low on memory, migrating to node " << Best << "\n");
+			++__spm_pressure_redirected;
+			__spm_node_free[Best] -= Bytes;
+			Node = Best;
+			return true;
+		}
+	}
+	else if (__spm_pressure == SPM_PRESSURE_SHRINK) {
+		long Room = (Free - __spm_min_free) >> __spm_page_exp;
+
+		if (Room > 0) {
+			SPMR_DEBUG(std::cout << "Runtime: node " << Node << " low on memory, migrating "
+							   << Room << " of " << PageEnd - PageStart << " pages\n");
+			++__spm_pressure_shrunk;
+			__spm_node_free[Node] -= Room << __spm_page_exp;
+			PageEnd = PageStart + Room;
+			return true;
+		}
+	}
+
+	SPMR_DEBUG(std::cout << "Runtime: node " << Node << " low on memory, not migrating\n");
+	++__spm_pressure_refused;
+	return false;
+}
+
+
+static void startMemoryMonitor() {
+	__spm_node_free = new std::atomic<long>[__spm_num_nodes];
+	refreshFreeMemory();
+
+	if (__spm_min_free <= 0)
+		return;
+
+	sem_init(&__spm_monitor_stop, 0, 0);
+	__spm_monitor_running = pthread_create(&__spm_monitor, NULL, memoryMonitor, NULL) == 0;
+}
+
+
+static void stopMemoryMonitor() {
+	if (__spm_monitor_running) {
+		sem_post(&__spm_monitor_stop);
+		pthread_join(__spm_monitor, NULL);
+		sem_destroy(&__spm_monitor_stop);
+		__spm_monitor_running = false;
+	}
+
+	delete[] __spm_node_free;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+// Binds the whole range to the node and lets the kernel migrate it.
+//Returns 0, or the errno of the last failed attempt.
+static int migrateHwloc(long PageStart, long PageEnd, int Node, MigrationStatus &Status) {
+	SPMR_DEBUG(std::cout << "Runtime: hwloc call: " << (PageStart << __spm_page_exp)
+					   << ", " << ((PageEnd - PageStart) << __spm_page_exp) << "\n");
+
+	for (int Attempt = 0; ; ++Attempt) {
+		if ( hwloc_set_area_membind(__spm_topo, (const void*)(PageStart << __spm_page_exp),
+								  (PageEnd - PageStart) << __spm_page_exp,
+								  (hwloc_const_cpuset_t)__spm_node_cpusets[Node], HWLOC_MEMBIND_BIND,
+								  HWLOC_MEMBIND_MIGRATE) != -1 ) {
+			Status.Moved += PageEnd - PageStart;
+			return 0;
+		}
+
+		int Err = errno;
+		countError(Err);
+
+		if ( !isTransient(Err) || Attempt >= __spm_retries ) {
+			if (Err == EBUSY)
+				Status.Busy += PageEnd - PageStart;
+			else
+				Status.Failed += PageEnd - PageStart;
+			return Err;
+		}
+
+		backoff(Attempt);
+	}
+}
+
+
+// Moves the range in batches of __spm_batch_pages with move_pages(2). Each
+//batch is queried first, so pages that are already on the node or that were
+//never touched are not handed to the kernel again. There is one entry every
+//Step pages, so a huge page is handed to the kernel once and moves whole.
+//Busy pages are retried with backoff. Returns 0, or the errno of a call
+//that failed as a whole.
+static int migrateMovePages(long PageStart, long PageEnd, int Node, MigrationStatus &Status, long Step = 1) {
+	const int Target = __spm_node_os_index[Node];
+	const long Batch = __spm_batch_pages;
+	int Result = 0;
+
+	ThreadContext &Ctx = __spm_context;
+	std::vector<void*> &Pages = Ctx.Pages, &ToMove = Ctx.ToMove, &Retry = Ctx.Retry;
+	std::vector<int> &PageStatus = Ctx.PageStatus, &Nodes = Ctx.Nodes;
+
+	PageStatus.resize(Batch);
+	Nodes.assign(Batch, Target);
+	Pages.reserve(Batch);
+	ToMove.reserve(Batch);
+	Retry.reserve(Batch);
+
+	for (long P = PageStart; P < PageEnd; P += Batch*Step) {
+		long N = std::min(Batch, (PageEnd - P + Step - 1) / Step);
+
+		Pages.clear();
+		for (long i=0; i<N; ++i)
+			Pages.push_back( (void*)((P + i*Step) << __spm_page_exp) );
+
+		ToMove.clear();
+		if ( move_pages(0, N, Pages.data(), NULL, PageStatus.data(), 0) != 0 ) {
+			ToMove = Pages; //status unknown, let the kernel sort it out
+		}
+		else {
+			for (long i=0; i<N; ++i) {
+				long Page = P + i*Step, Span = std::min(Step, PageEnd - Page);
+
+				if (__spm_shadow && PageStatus[i] >= 0)
+					SPMRM.set(Page, Page + Span, nodeFromOsIndex(PageStatus[i]));
+
+				if (PageStatus[i] == Target)
+					Status.Local += Span;
+				else if (PageStatus[i] == -ENOENT)
+					Status.Absent += Span;
+				else
+					ToMove.push_back(Pages[i]);
+			}
+		}
+
+		for (int Attempt = 0; !ToMove.empty(); ++Attempt) {
+			if ( move_pages(0, ToMove.size(), ToMove.data(), Nodes.data(), PageStatus.data(), MPOL_MF_MOVE) < 0 ) {
+				int Err = errno;
+				countError(Err);
+
+				if ( isTransient(Err) && Attempt < __spm_retries ) {
+					backoff(Attempt);
+					continue;
+				}
+
+				for (auto Addr : ToMove)
+					Status.Failed += std::min(Step, PageEnd - ((long)Addr >> __spm_page_exp));
+				Result = Err;
+				break;
+			}
+
+			Retry.clear();
+			for (size_t i=0; i<ToMove.size(); ++i) {
+				long Page = (long)ToMove[i] >> __spm_page_exp, Span = std::min(Step, PageEnd - Page);
+				int PS = PageStatus[i];
+
+				if (__spm_shadow && PS >= 0)
+					SPMRM.set(Page, Page + Span, nodeFromOsIndex(PS));
+
+				if (PS == Target)
+					Status.Moved += Span;
+				else if ( (PS == -EBUSY || PS == -EAGAIN) && Attempt < __spm_retries )
+					Retry.push_back(ToMove[i]);
+				else if (PS == -ENOENT)
+					Status.Absent += Span;
+				else {
+					countError(-PS);
+					if (PS == -EBUSY)
+						Status.Busy += Span;
+					else
+						Status.Failed += Span;
+				}
+			}
+
+			ToMove.swap(Retry);
+			if ( !ToMove.empty() )
+				backoff(Attempt);
+		}
+	}
+
+	return Result;
+}
+
+
+// With BasePages the range goes to move_pages(2) whatever the backend, so
+//that no mapping nor huge page is split to bind part of it.
+static int migrateBackend(long PageStart, long PageEnd, int Node, MigrationStatus &Status, long Step,
+						  bool BasePages) {
+	if (__spm_backend == SPM_BACKEND_MOVE_PAGES || BasePages)
+		return migrateMovePages(PageStart, PageEnd, Node, Status, Step);
+
+	int Err = migrateHwloc(PageStart, PageEnd, Node, Status);
+	if (__spm_shadow && Err == 0)
+		SPMRM.set(PageStart, PageEnd, Node);
+	return Err;
+}
+
+
+// Migrates to the node, or to the nearest allowed one if the process may not
+//use it, which is also tried when the kernel refuses the node itself.
+static void migrateRange(long PageStart, long PageEnd, int Node, MigrationStatus &Status, long Step,
+						 bool BasePages = false) {
+	if (PageStart >= PageEnd)
+		return;
+
+	int Target = nearestAllowedNode(Node);
+	if (Target < 0) {
+		Status.Failed += PageEnd - PageStart;
+		return;
+	}
+
+	MigrationStatus First = { 0, 0, 0, 0, 0 };
+	int Err = migrateBackend(PageStart, PageEnd, Target, First, Step, BasePages);
+
+	if (Err == EINVAL || Err == EPERM || Err == EACCES || Err == ENODEV) {
+		//maybe the cpuset changed under us
+		refreshAllowedNodes();
+
+		int Fallback = nearestAllowedNode(Target);
+		if (Fallback >= 0 && Fallback != Target) {
+			SPMR_DEBUG(std::cout << "Runtime: node " << Target << " refused (errno " << Err
+							   << "), falling back to node " << Fallback << "\n");
+
+			++__spm_fallbacks;
+			migrateBackend(PageStart, PageEnd, Fallback, Status, Step, BasePages);
+			return;
+		}
+	}
+
+	Status.Moved  += First.Moved;
+	Status.Local  += First.Local;
+	Status.Absent += First.Absent;
+	Status.Busy   += First.Busy;
+	Status.Failed += First.Failed;
+}
+
+
+// Migrates the range to the node. Returns whether all of it is there now,
+//i.e. the watermark let the whole range go to that very node and no page
+//failed or was busy.
+bool migrate(long PageStart, long PageEnd, int Node, SiteStats *Site = NULL) {
+	SPMR_DEBUG(std::cout << "Runtime: migrate pages: " << PageStart << " to "
+					   << PageEnd << " (node " << Node << ")\n");
+
+	long End = PageEnd;
+	int Target = Node;
+
+	if ( !admitMigration(PageStart, PageEnd, Node) )
+		return false;
+
+	MigrationStatus Status = { 0, 0, 0, 0, 0 };
+	long Start = nowNs();
+
+	long BodyStart, BodyEnd;
+	bool BaseEnds;
+	long Step = hugePageBody(PageStart, PageEnd, BodyStart, BodyEnd, BaseEnds);
+
+	SPMR_DEBUG(if (Step > 1)
+		std::cout << "Runtime: huge pages of " << (Step << __spm_page_exp)
+				  << " bytes, moving pages " << BodyStart << " to " << BodyEnd << " whole\n";
+	else if (BaseEnds)
+		std::cout << "Runtime: transparent huge pages, binding pages " << BodyStart << " to "
+				  << BodyEnd << ", moving the rest page by page\n");
+
+	migrateRange(PageStart, BodyStart, Node, Status, 1, BaseEnds);
+	migrateRange(BodyStart, BodyEnd, Node, Status, Step);
+	migrateRange(std::max(BodyEnd, PageStart), PageEnd, Node, Status, 1, BaseEnds);
+
+	if (__spm_madvise_huge)
+		adviseHugePages(PageStart, PageEnd);
+
+	SPMR_DEBUG(std::cout << "Runtime: pages moved: " << Status.Moved << ", local: "
+					   << Status.Local << ", absent: " << Status.Absent
+					   << ", busy: " << Status.Busy << ", failed: "
+					   << Status.Failed << "\n");
+
+	if (Site) {
+		Site->Bytes    += Status.Moved << __spm_page_exp;
+		Site->KernelNs += nowNs() - Start;
+	}
+
+	__spm_pages_moved  += Status.Moved;
+	__spm_pages_local  += Status.Local;
+	__spm_pages_busy   += Status.Busy;
+	__spm_pages_failed += Status.Failed;
+
+	return PageEnd == End && Node == Target && nearestAllowedNode(Node) == Node
+		&& Status.Busy == 0 && Status.Failed == 0;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//copy-and-remap backend (SPM_BACKEND=remap): ranges of at least
+//__spm_remap_bytes in private anonymous mappings, requested by the sites
+//listed in SPM_REMAP_SITES, are copied into a mapping bound to the
+//destination node, which then replaces them with mremap(2)
+long __spm_remap_bytes = REMAP_BYTES;
+std::atomic<long> __spm_remapped(0);
+std::atomic<long> __spm_remap_fallbacks(0);
+
+
+// Copies Len bytes, both ends page aligned, without pulling the destination
+//into the caches: the copy is not read again before the loop runs.
+static void streamCopy(char *Dst, const char *Src, long Len) {
+#ifdef __SSE2__
+	__m128i *D = (__m128i*)Dst;
+	const __m128i *S = (const __m128i*)Src;
+
+	for (long i=0; i<Len/16; i+=4) {
+		__m128i A = _mm_load_si128(S + i);
+		__m128i B = _mm_load_si128(S + i + 1);
+		__m128i C = _mm_load_si128(S + i + 2);
+		__m128i E = _mm_load_si128(S + i + 3);
+		_mm_stream_si128(D + i, A);
+		_mm_stream_si128(D + i + 1, B);
+		_mm_stream_si128(D + i + 2, C);
+		_mm_stream_si128(D + i + 3, E);
+	}
+
+	_mm_sfence();
+#else
+	memcpy(Dst, Src, Len);
+#endif
+}
+
+
+// Maps Len bytes bound to Node, at the same offset within a huge page as
+//Addr so that huge pages still line up once the mapping is moved there.
+//Returns NULL on failure.
+static char *mapStaging(long Addr, long Len, int Node, bool Huge) {
+	long Pad = Huge ? __spm_hpage_size : 0;
+
+	char *Map = (char*)mmap(NULL, Len + Pad, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (Map == MAP_FAILED)
+		return NULL;
+
+	char *Staging = Map;
+	if (Huge) {
+		Staging = Map + ((Addr - (long)Map) & (Pad - 1));
+		if (Staging > Map)
+			munmap(Map, Staging - Map);
+		if (Map + Pad > Staging)
+			munmap(Staging + Len, Map + Pad - Staging);
+		madvise(Staging, Len, MADV_HUGEPAGE);
+	}
+
+	if ( hwloc_set_area_membind(__spm_topo, Staging, Len, (hwloc_const_cpuset_t)__spm_node_cpusets[Node],
+								HWLOC_MEMBIND_BIND, 0) == -1 ) {
+		countError(errno);
+		munmap(Staging, Len);
+		return NULL;
+	}
+
+	return Staging;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//asynchronous mode (SPM_ASYNC=1): one migration thread per node, each fed
+//by its own bounded lock-free queue
+struct MigrationRequest {
+	long PageStart, PageEnd;
+	int Node;
+	SiteStats *Site;
+	void *Ary;               //array the registry knows the pages by, or NULL
+	sem_t *Done;             //posted once this part of a split migration is served, or NULL
+	char *CopyTo;            //if set, the pages are copied there, not migrated
+};
+
+// Bounded multi-producer/multi-consumer queue (D. Vyukov's design). Every
+//cell carries a sequence number telling producers and consumers whether it
+//is free or full for their current position.
+class RequestQueue {
+public:
+	RequestQueue(size_t Size) : Mask_(Size - 1), Cells_(new Cell[Size]), Head_(0), Tail_(0) {
+		assert((Size & (Size - 1)) == 0 && "Queue size must be a power of two");
+		for (size_t i=0; i<Size; ++i)
+			Cells_[i].Seq.store(i, std::memory_order_relaxed);
+	}
+
+	~RequestQueue() { delete[] Cells_; }
+
+	bool push(const MigrationRequest &Req) {
+		size_t Pos = Tail_.load(std::memory_order_relaxed);
+		Cell *C;
+
+		for (;;) {
+			C = &Cells_[Pos & Mask_];
+			size_t Seq = C->Seq.load(std::memory_order_acquire);
+			long Diff = (long)Seq - (long)Pos;
+
+			if (Diff == 0) {
+				if ( Tail_.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed) )
+					break;
+			}
+			else if (Diff < 0)
+				return false; //full
+			else
+				Pos = Tail_.load(std::memory_order_relaxed);
+		}
+
+		C->Req = Req;
+		C->Seq.store(Pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(MigrationRequest &Req) {
+		size_t Pos = Head_.load(std::memory_order_relaxed);
+		Cell *C;
+
+		for (;;) {
+			C = &Cells_[Pos & Mask_];
+			size_t Seq = C->Seq.load(std::memory_order_acquire);
+			long Diff = (long)Seq - (long)(Pos + 1);
+
+			if (Diff == 0) {
+				if ( Head_.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed) )
+					break;
+			}
+			else if (Diff < 0)
+				return false; //empty
+			else
+				Pos = Head_.load(std::memory_order_relaxed);
+		}
+
+		Req = C->Req;
+		C->Seq.store(Pos + Mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> Seq;
+		MigrationRequest Req;
+	};
+
+	const size_t Mask_;
+	Cell *const Cells_;
+
+	//keep producers and consumers on different cache lines
+	char Pad0_[64];
+	std::atomic<size_t> Head_;
+	char Pad1_[64];
+	std::atomic<size_t> Tail_;
+};
+
+//threads of one node serving a shared queue
+struct MigrationWorker {
+	pthread_t *Threads;
+	int NumThreads;
+	sem_t Ready;
+	RequestQueue *Queue;
+	int Node;
+};
+
+bool __spm_async = false;
+MigrationWorker* __spm_workers; //one thread per node, for SPM_ASYNC and SPM_CHUNKED
+MigrationWorker* __spm_helpers; //__spm_num_helpers per node, for SPM_HELPERS
+std::atomic<long> __spm_pending(0);
+pthread_mutex_t __spm_drained_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t __spm_drained = PTHREAD_COND_INITIALIZER; //__spm_pending hit 0
+std::atomic<bool> __spm_workers_stop(false);
+
+//chunked mode (SPM_CHUNKED=1): ranges the loop walks in a known direction
+//are migrated in chunks of __spm_chunk_bytes, in traversal order
+bool __spm_chunked = false;
+long __spm_chunk_bytes = CHUNK_BYTES;
+std::atomic<long> __spm_chunked_migrations(0);
+
+//parallel mode (SPM_HELPERS=N): synchronous migrations of at least
+//__spm_parallel_bytes are split among N helpers bound to the destination node
+long __spm_num_helpers = 0;
+long __spm_parallel_bytes = PARALLEL_BYTES;
+std::atomic<long> __spm_parallel_migrations(0);
+
+
+static void disown(void *Ary, long PageStart, long PageEnd, int Node);
+
+
+// Takes a request off __spm_pending, waking up stopWorkers with the last one.
+static void finishRequest() {
+	if ( __spm_pending.fetch_sub(1, std::memory_order_acq_rel) == 1 ) {
+		pthread_mutex_lock(&__spm_drained_lock);
+		pthread_cond_broadcast(&__spm_drained);
+		pthread_mutex_unlock(&__spm_drained_lock);
+	}
+}
+
+
+static void serve(const MigrationRequest &Req) {
+	if (Req.CopyTo)
+		streamCopy(Req.CopyTo, (const char*)(Req.PageStart << __spm_page_exp),
+				   (Req.PageEnd - Req.PageStart) << __spm_page_exp);
+	else if ( !migrate(Req.PageStart, Req.PageEnd, Req.Node, Req.Site) )
+		disown(Req.Ary, Req.PageStart, Req.PageEnd, Req.Node);
+}
+
+
+static void *migrationWorker(void *Arg) {
+	MigrationWorker *W = (MigrationWorker*)Arg;
+	MigrationRequest Req;
+
+	hwloc_set_thread_cpubind(__spm_topo, (hwloc_thread_t)pthread_self(),
+		(hwloc_const_cpuset_t)__spm_node_cpusets[W->Node], HWLOC_CPUBIND_THREAD);
+
+	for (;;) {
+		while ( sem_wait(&W->Ready) != 0 && errno == EINTR );
+
+		if ( W->Queue->pop(Req) ) {
+			serve(Req);
+			if (Req.Done)
+				sem_post(Req.Done);
+			finishRequest();
+		}
+		else if ( __spm_workers_stop.load(std::memory_order_acquire) )
+			break;
+	}
+
+	return NULL;
+}
+
+
+// Starts Threads threads per node, each node with its own queue.
+static MigrationWorker *startPool(int Threads) {
+	long QueueSize = getOption("SPM_QUEUE_SIZE", QUEUE_SIZE);
+	if (QueueSize < 2 || (QueueSize & (QueueSize - 1)) != 0)
+		QueueSize = QUEUE_SIZE;
+
+	MigrationWorker *Pool = new MigrationWorker[__spm_num_nodes];
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		MigrationWorker *W = &Pool[i];
+		W->Queue = new RequestQueue(QueueSize);
+		W->Node = i;
+		W->NumThreads = Threads;
+		W->Threads = new pthread_t[Threads];
+		sem_init(&W->Ready, 0, 0);
+
+		for (int t=0; t<Threads; ++t)
+			pthread_create(&W->Threads[t], NULL, migrationWorker, W);
+	}
+
+	return Pool;
+}
+
+
+static void stopPool(MigrationWorker *Pool) {
+	if (Pool == NULL)
+		return;
+
+	for (int i=0; i<__spm_num_nodes; ++i)
+		for (int t=0; t<Pool[i].NumThreads; ++t)
+			sem_post(&Pool[i].Ready);
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		for (int t=0; t<Pool[i].NumThreads; ++t)
+			pthread_join(Pool[i].Threads[t], NULL);
+
+		sem_destroy(&Pool[i].Ready);
+		delete Pool[i].Queue;
+		delete[] Pool[i].Threads;
+	}
+
+	delete[] Pool;
+}
+
+
+static void startWorkers() {
+	if (__spm_async || __spm_chunked)
+		__spm_workers = startPool(1);
+
+	if (__spm_num_helpers > 0)
+		__spm_helpers = startPool(__spm_num_helpers);
+}
+
+
+// Waits until every queued request has been served, then stops the workers.
+static void stopWorkers() {
+	pthread_mutex_lock(&__spm_drained_lock);
+	while ( __spm_pending.load(std::memory_order_acquire) > 0 )
+		pthread_cond_wait(&__spm_drained, &__spm_drained_lock);
+	pthread_mutex_unlock(&__spm_drained_lock);
+
+	__spm_workers_stop.store(true, std::memory_order_release);
+
+	stopPool(__spm_workers);
+	stopPool(__spm_helpers);
+	__spm_workers = __spm_helpers = NULL;
+}
+
+
+// Queues the request for the threads of the node. Returns false if the
+//queue is full.
+static bool enqueue(MigrationWorker *W, const MigrationRequest &Req) {
+	__spm_pending.fetch_add(1, std::memory_order_relaxed);
+
+	if ( !W->Queue->push(Req) ) {
+		finishRequest();
+		return false;
+	}
+
+	sem_post(&W->Ready);
+	return true;
+}
+
+
+// Hands the request to the worker of the destination node. Returns false if
+//its queue is full, in which case the caller migrates synchronously.
+static bool enqueueMigration(void *Ary, long PageStart, long PageEnd, int Node, SiteStats *Site) {
+	MigrationRequest Req = { PageStart, PageEnd, Node, Site, Ary, NULL, NULL };
+	return enqueue(&__spm_workers[Node], Req);
+}
+
+
+// Splits the range into one part per helper of the node plus one for the
+//calling thread, at huge page boundaries, and waits for all of them. Parts
+//are migrated or, if CopyTo is set, copied to the same offset from it.
+static void splitAmongHelpers(void *Ary, long PageStart, long PageEnd, int Node, SiteStats *Site, char *CopyTo) {
+	long Huge = __spm_hpage_size >> __spm_page_exp;
+	long Parts = __spm_helpers ? __spm_num_helpers + 1 : 1;
+	long Part = std::max(Huge, (PageEnd - PageStart) / Parts);
+
+	sem_t Done;
+	long Queued = 0;
+	sem_init(&Done, 0, 0);
+	long P = PageStart;
+
+	for (long i=0; i<Parts; ++i) {
+		long E = (i == Parts - 1) ? PageEnd : std::min(PageEnd, (P + Part) / Huge * Huge);
+		if (E <= P)
+			continue;
+
+		char *To = CopyTo ? CopyTo + ((P - PageStart) << __spm_page_exp) : NULL;
+		MigrationRequest Req = { P, E, Node, Site, Ary, &Done, To };
+
+		if ( i < Parts - 1 && enqueue(&__spm_helpers[Node], Req) )
+			++Queued;
+		else
+			serve(Req);
+
+		P = E;
+	}
+
+	//sleep rather than spin: the helpers need the cores of the node
+	for (; Queued > 0; --Queued)
+		while ( sem_wait(&Done) != 0 && errno == EINTR );
+
+	sem_destroy(&Done);
+}
+
+
+// Splits a large migration among the helpers, so several kernel contexts
+//copy at once.
+static void migrateParallel(void *Ary, long PageStart, long PageEnd, int Node, SiteStats *Site) {
+	++__spm_parallel_migrations;
+	splitAmongHelpers(Ary, PageStart, PageEnd, Node, Site, NULL);
+}
+
+
+// Copies the pages inside the bytes [Begin, End) into a mapping bound to the
+//node, with the helpers of the node if there are any, and moves that mapping
+//over them; the page Begin shares with bytes before it is migrated with
+//migrate(). Only safe while no other thread writes the pages, hence only
+//used by the synchronous path for ranges no other node holds; madvise(2)
+//flags set on the old pages are lost. Returns false, with nothing changed,
+//if the range does not qualify or a step fails, in which case the caller
+//migrates it with migrate().
+static bool migrateRemap(void *Ary, long Begin, long End, int Node, SiteStats *Site) {
+	long Head = Begin >> __spm_page_exp;
+	long PageStart = (Begin + __spm_page_size - 1) >> __spm_page_exp;
+	long PageEnd = End >> __spm_page_exp;
+
+	long Addr = PageStart << __spm_page_exp;
+	long Len = (PageEnd - PageStart) << __spm_page_exp;
+
+	if (Len < __spm_remap_bytes)
+		return false;
+
+	MappingCache::Mapping M;
+	if ( !SPMMC.lookup(Addr, M) || !M.Remappable || M.Start > Addr || M.End < Addr + Len ) {
+		++__spm_remap_fallbacks;
+		return false;
+	}
+
+	int Target = nearestAllowedNode(Node);
+	if (Target < 0)
+		return false;
+
+	long Admitted = PageEnd;
+	if ( !admitMigration(PageStart, Admitted, Target) ) {
+		disown(Ary, Head, PageEnd, Node);
+		return true;
+	}
+
+	//pages left out, or a range going elsewhere, are not the node's
+	if (Target != Node)
+		disown(Ary, Head, PageEnd, Node);
+	else if (Admitted < PageEnd)
+		disown(Ary, Admitted, PageEnd, Node);
+
+	PageEnd = Admitted;
+	Len = (PageEnd - PageStart) << __spm_page_exp;
+
+	long Start = nowNs();
+
+	char *Staging = mapStaging(Addr, Len, Target, M.PageSize > __spm_page_size || M.Thp);
+	if (Staging == NULL) {
+		++__spm_remap_fallbacks;
+		return false;
+	}
+
+	splitAmongHelpers(NULL, PageStart, PageEnd, Target, Site, Staging);
+
+	if ( mremap(Staging, Len, Len, MREMAP_MAYMOVE | MREMAP_FIXED, (void*)Addr) == MAP_FAILED ) {
+		countError(errno);
+		munmap(Staging, Len);
+		++__spm_remap_fallbacks;
+		return false;
+	}
+
+	SPMR_DEBUG(std::cout << "Runtime: remapped " << Len << " bytes to node " << Target << "\n");
+
+	if (__spm_shadow)
+		SPMRM.set(PageStart, PageEnd, Target);
+
+	if (Site) {
+		Site->Bytes    += Len;
+		Site->KernelNs += nowNs() - Start;
+	}
+
+	++__spm_remapped;
+	__spm_pages_moved += PageEnd - PageStart;
+
+	if ( Head < PageStart && !migrate(Head, PageStart, Node, Site) )
+		disown(Ary, Head, PageStart, Node);
+	return true;
+}
+
+
+// Migrates the chunk the loop touches first synchronously, so the loop can
+//start, and queues the others, in the order the loop reaches them, for the
+//migration thread of the node. Chunk boundaries are multiples of the chunk
+//size, itself a multiple of the huge page size. If the queue fills up, the
+//rest goes as one request, or synchronously.
+static void migrateChunked(void *Ary, long PageStart, long PageEnd, int Node, int Direction, SiteStats *Site) {
+	long Huge = __spm_hpage_size >> __spm_page_exp;
+	long Chunk = std::max(Huge, (__spm_chunk_bytes >> __spm_page_exp) / Huge * Huge);
+	bool Up = Direction > 0;
+
+	long Lo = Up ? PageStart : std::max(PageStart, (PageEnd - 1) / Chunk * Chunk);
+	long Hi = Up ? std::min(PageEnd, (PageStart / Chunk + 1) * Chunk) : PageEnd;
+
+	//a first chunk of a few pages would not let the loop get far
+	if (Hi - Lo < Chunk / 2) {
+		if (Up)
+			Hi = std::min(PageEnd, Hi + Chunk);
+		else
+			Lo = std::max(PageStart, Lo - Chunk);
+	}
+
+	++__spm_chunked_migrations;
+	if ( !migrate(Lo, Hi, Node, Site) )
+		disown(Ary, Lo, Hi, Node);
+
+	while (Up ? Hi < PageEnd : Lo > PageStart) {
+		long S = Up ? Hi : std::max(PageStart, Lo - Chunk);
+		long E = Up ? std::min(PageEnd, Hi + Chunk) : Lo;
+
+		if ( !enqueueMigration(Ary, S, E, Node, Site) ) {
+			long RestStart = Up ? Hi : PageStart, RestEnd = Up ? PageEnd : Lo;
+
+			if ( !enqueueMigration(Ary, RestStart, RestEnd, Node, Site)
+					&& !migrate(RestStart, RestEnd, Node, Site) )
+				disown(Ary, RestStart, RestEnd, Node);
+			return;
+		}
+
+		if (Up)
+			Hi = E;
+		else
+			Lo = S;
+	}
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+// Records which node owns which page range, so that a range is not migrated
+//again to the node that already holds it, and so that a range that has just
+//been migrated stays put for at least __spm_min_residency microseconds
+//before another node may take it (no ping-pong between threads).
+//
+// Ranges are sharded by the base address of the array they belong to; each
+//shard is protected by a reader-writer lock and lookups only take it for
+//reading.
+class PageIntervals {
+public:
+	enum Verdict {
+		MIGRATE,  //range (now) belongs to the caller's node
+		OWNED,    //already owned by the caller's node
+		RESIDENT  //recently migrated to another node
+	};
+
+	PageIntervals() {
+		for (int i=0; i<REGISTRY_SHARDS; ++i)
+			pthread_rwlock_init(&Shards_[i].Lock, NULL);
+	}
+
+	Verdict acquire(void *Ary, long Start, long End, int Node, long Now, bool *Foreign = NULL);
+	long release(void *Ary, long Start, long End, int Node);
+
+private:
+	struct PageRegion {
+		long End;
+		int Node;
+		long Stamp; //when the region was migrated, in microseconds
+	};
+
+	typedef std::map<long, PageRegion> RegionsTy;
+
+	struct Shard {
+		pthread_rwlock_t Lock;
+		RegionsTy Regions;
+		char Pad[64];
+	};
+
+	Shard &getShard(void *Ary) {
+		unsigned long Key = ((unsigned long)Ary >> __spm_page_exp) * 0x9E3779B97F4A7C15UL;
+		return Shards_[(Key >> 32) % REGISTRY_SHARDS];
+	}
+
+	Verdict check(RegionsTy &Regions, long Start, long End, int Node, long Now, bool *Foreign = NULL);
+	void insert(RegionsTy &Regions, long Start, long End, int Node, long Now);
+
+	Shard Shards_[REGISTRY_SHARDS];
+};
+
+
+PageIntervals::Verdict PageIntervals::check(RegionsTy &Regions, long Start, long End, int Node, long Now, bool *Foreign) {
+	RegionsTy::iterator It = Regions.upper_bound(Start);
+	if ( It != Regions.begin() )
+		--It;
+
+	long Covered = Start;
+	bool Owned = true;
+
+	for (; It != Regions.end() && It->first < End; ++It) {
+		if (It->second.End <= Start)
+			continue;
+
+		if (It->second.Node != Node) {
+			if (Now - It->second.Stamp < __spm_min_residency)
+				return RESIDENT;
+			Owned = false;
+		}
+		else if (It->first <= Covered) {
+			Covered = std::max(Covered, It->second.End);
+		}
+	}
+
+	if (Foreign)
+		*Foreign = !Owned;
+
+	return (Owned && Covered >= End) ? OWNED : MIGRATE;
+}
+
+
+void PageIntervals::insert(RegionsTy &Regions, long Start, long End, int Node, long Now) {
+	RegionsTy::iterator It = Regions.upper_bound(Start);
+	if ( It != Regions.begin() )
+		--It;
+
+	while (It != Regions.end() && It->first < End) {
+		long RStart = It->first;
+		PageRegion R = It->second;
+
+		if (R.End <= Start) {
+			++It;
+			continue;
+		}
+
+		Regions.erase(It++);
+
+		//
+		// R |---- ---- ---- ----|
+		// N      |---- ----|
+		//
+		if (RStart < Start)
+			Regions[RStart] = { Start, R.Node, R.Stamp };
+		if (R.End > End)
+			It = Regions.insert(std::make_pair(End, PageRegion{ R.End, R.Node, R.Stamp })).first;
+	}
+
+	Regions[Start] = { End, Node, Now };
+}
+
+
+// Takes [Start, End) for Node unless it already owns it or another node got
+//it recently. Foreign, if given, tells whether another node held any of it.
+PageIntervals::Verdict PageIntervals::acquire(void *Ary, long Start, long End, int Node, long Now, bool *Foreign) {
+	Shard &S = getShard(Ary);
+
+	pthread_rwlock_rdlock(&S.Lock);
+	Verdict V = check(S.Regions, Start, End, Node, Now);
+	pthread_rwlock_unlock(&S.Lock);
+
+	if (V != MIGRATE)
+		return V;
+
+	pthread_rwlock_wrlock(&S.Lock);
+	V = check(S.Regions, Start, End, Node, Now, Foreign); //may have changed meanwhile
+	if (V == MIGRATE)
+		insert(S.Regions, Start, End, Node, Now);
+	pthread_rwlock_unlock(&S.Lock);
+
+	return V;
+}
+
+// Forgets that Node owns the pages of [Start, End) it holds, so that any
+//node may take them at once; with Node -1, whichever node holds them.
+//Returns how many pages were released.
+long PageIntervals::release(void *Ary, long Start, long End, int Node) {
+	Shard &S = getShard(Ary);
+	long Released = 0;
+
+	pthread_rwlock_wrlock(&S.Lock);
+
+	RegionsTy::iterator It = S.Regions.upper_bound(Start);
+	if ( It != S.Regions.begin() )
+		--It;
+
+	while (It != S.Regions.end() && It->first < End) {
+		long RStart = It->first;
+		PageRegion R = It->second;
+
+		if (R.End <= Start || (Node >= 0 && R.Node != Node)) {
+			++It;
+			continue;
+		}
+
+		S.Regions.erase(It++);
+		Released += std::min(R.End, End) - std::max(RStart, Start);
+
+		if (RStart < Start)
+			S.Regions[RStart] = { Start, R.Node, R.Stamp };
+		if (R.End > End)
+			It = S.Regions.insert(std::make_pair(End, PageRegion{ R.End, R.Node, R.Stamp })).first;
+	}
+
+	pthread_rwlock_unlock(&S.Lock);
+	return Released;
+}
+
+bool __spm_registry = true;
+static PageIntervals SPMPI;
+
+
+// Takes back the claim __spm_get made for Node on pages of Ary that did not
+//end up there, so that the next request for them migrates again.
+static void disown(void *Ary, long PageStart, long PageEnd, int Node) {
+	if (Ary == NULL || !__spm_registry || PageStart >= PageEnd)
+		return;
+
+	SPMR_DEBUG(std::cout << "Runtime: pages " << PageStart << " to " << PageEnd
+					   << " not moved, node " << Node << " does not own them\n");
+	SPMPI.release(Ary, PageStart, PageEnd, Node);
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//interleaving (SPM_INTERLEAVE=n): when the ranges that threads of n or more
+//nodes requested of an array within __spm_interleave_us overlap, no single
+//node should own them; their union is interleaved over those nodes instead
+long __spm_interleave = 0;
+long __spm_interleave_us = INTERLEAVE_US;
+std::atomic<long> __spm_interleaved(0);
+std::atomic<long> __spm_interleave_hits(0);
+
+class ContentionTracker {
+public:
+	struct Interleaving {
+		long Ary;
+		long PageStart, PageEnd;
+		std::vector<bool> Nodes;
+		const SiteInfo *Info; //of the call that triggered it, if known
+	};
+
+	ContentionTracker() {
+		for (int i=0; i<REGISTRY_SHARDS; ++i)
+			pthread_mutex_init(&Shards_[i].Lock, NULL);
+	}
+
+	// Records the request of Node for [PageStart, PageEnd) of Ary. Returns
+	//true if the range is interleaved, which it becomes if the request makes
+	//it contended; the caller must then not migrate it.
+	bool contended(void *Ary, long PageStart, long PageEnd, int Node, long Now, const SiteInfo *Info);
+
+	// Drops the last request of Node, which is done with the array.
+	void release(void *Ary, int Node) {
+		Shard &S = getShard(Ary);
+		pthread_mutex_lock(&S.Lock);
+		auto It = S.Arrays.find((long)Ary);
+		if ( It != S.Arrays.end() && !It->second.Stamp.empty() )
+			It->second.Stamp[Node] -= __spm_interleave_us; //out of the window
+		pthread_mutex_unlock(&S.Lock);
+	}
+
+	void forEach(std::function<void(const Interleaving&)> Fn) {
+		for (int i=0; i<REGISTRY_SHARDS; ++i) {
+			pthread_mutex_lock(&Shards_[i].Lock);
+			for (auto &Entry : Shards_[i].Arrays)
+				if (Entry.second.Interleaved.PageEnd > Entry.second.Interleaved.PageStart)
+					Fn(Entry.second.Interleaved);
+			pthread_mutex_unlock(&Shards_[i].Lock);
+		}
+	}
+
+private:
+	struct History {
+		std::vector<long> Start, End, Stamp; //last request of every node
+		Interleaving Interleaved;            //empty range if none
+	};
+
+	struct Shard {
+		pthread_mutex_t Lock;
+		std::unordered_map<long, History> Arrays;
+		char Pad[64];
+	};
+
+	Shard &getShard(void *Ary) {
+		unsigned long Key = ((unsigned long)Ary >> __spm_page_exp) * 0x9E3779B97F4A7C15UL;
+		return Shards_[(Key >> 32) % REGISTRY_SHARDS];
+	}
+
+	Shard Shards_[REGISTRY_SHARDS];
+};
+
+
+bool ContentionTracker::contended(void *Ary, long PageStart, long PageEnd, int Node, long Now, const SiteInfo *Info) {
+	Shard &S = getShard(Ary);
+	pthread_mutex_lock(&S.Lock);
+
+	History &H = S.Arrays[(long)Ary];
+	Interleaving &I = H.Interleaved;
+
+	if ( H.Stamp.empty() ) {
+		H.Start.assign(__spm_num_nodes, 0);
+		H.End.assign(__spm_num_nodes, 0);
+		H.Stamp.assign(__spm_num_nodes, Now - __spm_interleave_us);
+		I = { (long)Ary, 0, 0, std::vector<bool>(__spm_num_nodes, false), NULL };
+	}
+
+	if ( I.PageStart <= PageStart && PageEnd <= I.PageEnd && I.Nodes[Node] ) {
+		pthread_mutex_unlock(&S.Lock);
+		++__spm_interleave_hits;
+		return true;
+	}
+
+	H.Start[Node] = PageStart;
+	H.End[Node] = PageEnd;
+	H.Stamp[Node] = Now;
+
+	//nodes whose last request is recent and overlaps this one
+	std::vector<bool> Nodes(__spm_num_nodes, false);
+	long Count = 0, Lo = PageStart, Hi = PageEnd;
+
+	for (int i=0; i<__spm_num_nodes; ++i)
+		if ( Now - H.Stamp[i] < __spm_interleave_us && H.Start[i] < PageEnd && PageStart < H.End[i] ) {
+			Nodes[i] = true;
+			++Count;
+			Lo = std::min(Lo, H.Start[i]);
+			Hi = std::max(Hi, H.End[i]);
+		}
+
+	if (Count < __spm_interleave) {
+		pthread_mutex_unlock(&S.Lock);
+		return false;
+	}
+
+	//grow an overlapping interleaving instead of starting another one
+	if ( I.PageStart < Hi && Lo < I.PageEnd ) {
+		Lo = std::min(Lo, I.PageStart);
+		Hi = std::max(Hi, I.PageEnd);
+		for (int i=0; i<__spm_num_nodes; ++i)
+			Nodes[i] = Nodes[i] || I.Nodes[i];
+	}
+
+	hwloc_bitmap_t Set = hwloc_bitmap_alloc();
+	for (int i=0; i<__spm_num_nodes; ++i)
+		if (Nodes[i])
+			hwloc_bitmap_or(Set, Set, __spm_node_cpusets[i]);
+
+	SPMR_DEBUG(std::cout << "Runtime: pages " << Lo << " to " << Hi << " of " << Ary
+					   << " requested by " << Count << " nodes, interleaving\n");
+
+	bool Done = hwloc_set_area_membind(__spm_topo, (const void*)(Lo << __spm_page_exp), (Hi - Lo) << __spm_page_exp,
+									   (hwloc_const_cpuset_t)Set, HWLOC_MEMBIND_INTERLEAVE,
+									   HWLOC_MEMBIND_MIGRATE) != -1;
+	if (!Done)
+		countError(errno);
+	hwloc_bitmap_free(Set);
+
+	if (Done) {
+		I.PageStart = Lo;
+		I.PageEnd = Hi;
+		I.Nodes = Nodes;
+		if (Info)
+			I.Info = Info;
+		++__spm_interleaved;
+	}
+
+	pthread_mutex_unlock(&S.Lock);
+	return Done;
+}
+
+static ContentionTracker SPMCT;
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//release at loop exit: the pass calls __spm_release for the range of every
+//__spm_get once the loop that needed it is done, which hands the range back
+//(only with SPM_RELEASE=1, as it also drops the residency stamp) and with
+//SPM_RELEASE_COLD=1 also marks its pages as the first to reclaim
+bool __spm_release_enabled = false;
+bool __spm_release_cold = false;
+std::atomic<long> __spm_released_pages(0);
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//migration heuristics, selected with SPM_HEURISTIC; each one decides
+//whether a range of Size bytes that the loop touches Reuse bytes worth of
+//times should be migrated
+typedef bool (*HeuristicFn)(long Size, long Reuse, int Node);
+
+//cost model parameters, in nanoseconds per byte
+double __spm_local_ns  = 0.1;
+double __spm_remote_ns = 0.2;
+double __spm_migrate_ns = 1.0;
+
+//calibrated cost model (SPM_CALIBRATE=1): migration cost per size class and
+//read cost for every (CPU node, memory node) pair
+const int MIGRATE_CLASSES = 3;
+const long __spm_migrate_class_size[MIGRATE_CLASSES] = { 64L << 10, 1L << 20, 16L << 20 };
+double __spm_migrate_class_ns[MIGRATE_CLASSES];
+double* __spm_read_ns;    //__spm_num_nodes x __spm_num_nodes
+double* __spm_penalty_ns; //per node: mean remote minus local read cost
+bool __spm_calibrated = false;
+
+
+// Original formula: the range must not fit in cache and must be reused
+//often enough.
+static bool reuseHeuristic(long Size, long Reuse, int) {
+	return (double)Size > __spm_CacheConstant*__spm_cache_size && (double)Reuse/(Size > 0 ? Size : 100000) > __spm_ReuseConstant;
+}
+
+
+// Migration cost of a range, in nanoseconds per byte.
+static double migrationCost(long Size) {
+	if (!__spm_calibrated)
+		return __spm_migrate_ns;
+
+	int Class = 0;
+	while (Class + 1 < MIGRATE_CLASSES && Size >= __spm_migrate_class_size[Class + 1])
+		++Class;
+	return __spm_migrate_class_ns[Class];
+}
+
+
+// Migrates when the time saved by reading locally instead of remotely
+//exceeds the time spent moving the range.
+static bool costHeuristic(long Size, long Reuse, int Node) {
+	double Penalty = __spm_calibrated ? __spm_penalty_ns[Node] : __spm_remote_ns - __spm_local_ns;
+	return (double)Reuse*Penalty > (double)Size*migrationCost(Size);
+}
+
+
+static bool alwaysHeuristic(long, long, int) {
+	return true;
+}
+
+
+static bool neverHeuristic(long, long, int) {
+	return false;
+}
+
+
+static const struct {
+	const char *Name;
+	HeuristicFn Fn;
+} __spm_heuristics[] = {
+	{ "reuse",  reuseHeuristic  },
+	{ "cost",   costHeuristic   },
+	{ "always", alwaysHeuristic },
+	{ "never",  neverHeuristic  }
+};
+
+HeuristicFn __spm_heuristic = reuseHeuristic;
+
+
+static void setupHeuristic() {
+	const char *Name = getStringOption("SPM_HEURISTIC", "reuse");
+
+	__spm_heuristic = NULL;
+	for (size_t i=0; i<sizeof(__spm_heuristics)/sizeof(__spm_heuristics[0]); ++i)
+		if ( !strcmp(Name, __spm_heuristics[i].Name) )
+			__spm_heuristic = __spm_heuristics[i].Fn;
+
+	if (__spm_heuristic == NULL) {
+		fprintf(stderr, "SPM runtime: unknown heuristic %s, using reuse\n", Name);
+		__spm_heuristic = reuseHeuristic;
+	}
+
+	__spm_ReuseConstant = getFloatOption("SPM_REUSE", REUSE_CTE);
+	__spm_CacheConstant = getFloatOption("SPM_CACHE_FRACTION", 0.2);
+
+	__spm_local_ns   = getFloatOption("SPM_LOCAL_NS_PER_BYTE", __spm_local_ns);
+	__spm_remote_ns  = getFloatOption("SPM_REMOTE_NS_PER_BYTE", __spm_remote_ns);
+	__spm_migrate_ns = getFloatOption("SPM_MIGRATE_NS_PER_BYTE", __spm_migrate_ns);
+
+	SPMR_DEBUG(std::cout << "Runtime: heuristic " << Name << ", reuse "
+					   << __spm_ReuseConstant << ", cache fraction "
+					   << __spm_CacheConstant << ", ns/byte local "
+					   << __spm_local_ns << ", remote " << __spm_remote_ns
+					   << ", migration " << __spm_migrate_ns << "\n");
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//calibration buffers are read through this, so the reads are not optimized
+//away
+volatile unsigned long __spm_calibration_sink;
+
+
+// Maps Size bytes of anonymous memory on the given node and populates them.
+static void *allocOnNode(long Size, int Node) {
+	void *Buf = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (Buf == MAP_FAILED)
+		return NULL;
+
+	hwloc_set_area_membind(__spm_topo, Buf, Size, (hwloc_const_cpuset_t)__spm_node_cpusets[Node],
+						   HWLOC_MEMBIND_BIND, HWLOC_MEMBIND_MIGRATE);
+	memset(Buf, 1, Size);
+	return Buf;
+}
+
+
+// Reading cost, in nanoseconds per byte, of memory on node Mem from a
+//thread running on node Cpu.
+static double measureRead(int Cpu, int Mem) {
+	const long Size = 32L << 20;
+
+	hwloc_set_cpubind(__spm_topo, (hwloc_const_cpuset_t)__spm_node_cpusets[Cpu], HWLOC_CPUBIND_THREAD);
+
+	unsigned long *Buf = (unsigned long*)allocOnNode(Size, Mem);
+	if (Buf == NULL)
+		return 0;
+
+	double Best = 0;
+	for (int Run = 0; Run < 3; ++Run) {
+		unsigned long Sum = 0;
+		long Start = nowNs();
+		for (long i=0; i<Size/(long)sizeof(unsigned long); ++i)
+			Sum += Buf[i];
+		long Elapsed = nowNs() - Start;
+		__spm_calibration_sink = Sum;
+
+		double Ns = (double)Elapsed/Size;
+		if (Run == 0 || Ns < Best)
+			Best = Ns;
+	}
+
+	munmap(Buf, Size);
+	return Best;
+}
+
+
+// Cost, in nanoseconds per byte, of moving Size bytes between two nodes
+//with the selected backend.
+static double measureMigration(long Size, int From, int To) {
+	void *Buf = allocOnNode(Size, From);
+	if (Buf == NULL)
+		return __spm_migrate_ns;
+
+	long PageStart = (long)Buf >> __spm_page_exp;
+	long PageEnd = ((long)Buf + Size) >> __spm_page_exp;
+	MigrationStatus Status = { 0, 0, 0, 0, 0 };
+
+	long Start = nowNs();
+	if (__spm_backend == SPM_BACKEND_MOVE_PAGES)
+		migrateMovePages(PageStart, PageEnd, To, Status);
+	else
+		migrateHwloc(PageStart, PageEnd, To, Status);
+	long Elapsed = nowNs() - Start;
+
+	//the backend shadowed the pages; memory mapped there later is not local
+	munmap(Buf, Size);
+	SPMRM.forget(PageStart, PageEnd);
+	return (double)Elapsed/Size;
+}
+
+
+// Node distances relative to the local distance, NULL if hwloc has none.
+static double *getDistances() {
+	const int N = __spm_num_nodes;
+	double *Dist = NULL;
+
+#if HWLOC_API_VERSION >= 0x00020000
+	unsigned Nr = 1;
+	struct hwloc_distances_s *D;
+	if ( hwloc_distances_get_by_type(__spm_topo, HWLOC_OBJ_NUMANODE, &Nr, &D, HWLOC_DISTANCES_KIND_MEANS_LATENCY, 0) == 0 && Nr > 0 ) {
+		if ( (int)D->nbobjs == N ) {
+			Dist = new double[N*N];
+			for (int i=0; i<N; ++i)
+				for (int j=0; j<N; ++j)
+					Dist[i*N + j] = (double)D->values[i*N + j]/D->values[i*N + i];
+		}
+		hwloc_distances_release(__spm_topo, D);
+	}
+#else
+	const struct hwloc_distances_s *D = hwloc_get_whole_distance_matrix_by_type(__spm_topo, HWLOC_OBJ_NODE);
+	if ( D != NULL && (int)D->nbobjs == N ) {
+		Dist = new double[N*N];
+		for (int i=0; i<N; ++i)
+			for (int j=0; j<N; ++j)
+				Dist[i*N + j] = D->latency[i*N + j]/D->latency[i*N + i];
+	}
+#endif
+
+	return Dist;
+}
+
+
+static void calibrate() {
+	const int N = __spm_num_nodes;
+
+	SPMR_DEBUG(std::cout << "Runtime: calibrating " << N << " nodes\n");
+
+	//before the read measurements below move the thread around
+	int Home = currentNode();
+
+	//local reads on every node; remote reads are measured for every pair,
+	//or scaled from the local ones by the node distances when known
+	double *Dist = getDistances();
+	for (int i=0; i<N; ++i)
+		__spm_read_ns[i*N + i] = measureRead(i, i);
+
+	for (int i=0; i<N; ++i)
+		for (int j=0; j<N; ++j)
+			if (i != j)
+				__spm_read_ns[i*N + j] = Dist ? __spm_read_ns[i*N + i]*Dist[i*N + j] : measureRead(i, j);
+	delete[] Dist;
+
+	//one pair of nodes stands for all of them: from the node the program
+	//started on, which usually first-touches the data, to the next one
+	for (int c=0; c<MIGRATE_CLASSES; ++c)
+		__spm_migrate_class_ns[c] = (N > 1) ? measureMigration(__spm_migrate_class_size[c], Home, (Home + 1) % N) : __spm_migrate_ns;
+
+	hwloc_set_cpubind(__spm_topo, (hwloc_const_cpuset_t)__spm_full_cpuset, HWLOC_CPUBIND_THREAD);
+}
+
+
+// Calibration results are kept in <state dir>/calibration-<host>-<nodes>-<backend>.
+static std::string calibrationFile() {
+	std::string Dir = getStringOption("SPM_STATE_DIR", "");
+
+	if ( Dir.empty() ) {
+		const char *Home = getenv("HOME");
+		Dir = std::string(Home ? Home : "/tmp") + "/.cache/spm";
+	}
+
+	//create every missing component
+	for (size_t Pos = 0; Pos != std::string::npos; ) {
+		Pos = Dir.find('/', Pos + 1);
+		mkdir(Dir.substr(0, Pos).c_str(), 0755);
+	}
+
+	char Host[256] = {0};
+	gethostname(Host, sizeof(Host) - 1);
+
+	return Dir + "/calibration-" + Host + "-" + std::to_string(__spm_num_nodes)
+		+ (__spm_backend == SPM_BACKEND_MOVE_PAGES ? "-move_pages" : "-hwloc");
+}
+
+
+static bool loadCalibration(const std::string &Name) {
+	const int N = __spm_num_nodes;
+	std::ifstream File(Name.c_str());
+	if (!File)
+		return false;
+
+	int Nodes = -1, Read = 0, Migrate = 0;
+	std::string Key;
+	while (File >> Key) {
+		if (Key == "nodes")
+			File >> Nodes;
+		else if (Key == "migrate" && Migrate < MIGRATE_CLASSES)
+			File >> __spm_migrate_class_ns[Migrate++];
+		else if (Key == "read" && Read < N*N)
+			File >> __spm_read_ns[Read++];
+		else
+			return false;
+	}
+
+	return Nodes == N && Read == N*N && Migrate == MIGRATE_CLASSES;
+}
+
+
+static void saveCalibration(const std::string &Name) {
+	const int N = __spm_num_nodes;
+	std::ofstream File(Name.c_str());
+	if (!File)
+		return;
+
+	File << "nodes " << N << "\n";
+	for (int c=0; c<MIGRATE_CLASSES; ++c)
+		File << "migrate " << __spm_migrate_class_ns[c] << "\n";
+	for (int i=0; i<N*N; ++i)
+		File << "read " << __spm_read_ns[i] << "\n";
+}
+
+
+// Sets up the calibrated cost model, measuring this machine only if there
+//are no saved results for it. The cost heuristic becomes the default.
+static void setupCalibration() {
+	const int N = __spm_num_nodes;
+
+	__spm_read_ns = new double[N*N];
+	__spm_penalty_ns = new double[N];
+
+	std::string Name = calibrationFile();
+	if ( !loadCalibration(Name) ) {
+		calibrate();
+		saveCalibration(Name);
+	}
+
+	for (int i=0; i<N; ++i) {
+		double Remote = 0;
+		for (int j=0; j<N; ++j)
+			if (i != j)
+				Remote += __spm_read_ns[i*N + j];
+
+		__spm_penalty_ns[i] = (N > 1) ? Remote/(N - 1) - __spm_read_ns[i*N + i] : 0;
+
+		SPMR_DEBUG(std::cout << "Runtime: node " << i << " local read "
+						   << __spm_read_ns[i*N + i] << " ns/byte, remote penalty "
+						   << __spm_penalty_ns[i] << " ns/byte\n");
+	}
+
+	SPMR_DEBUG(
+		for (int c=0; c<MIGRATE_CLASSES; ++c)
+			std::cout << "Runtime: migration of " << __spm_migrate_class_size[c]
+					  << " bytes: " << __spm_migrate_class_ns[c] << " ns/byte\n";
+	);
+
+	__spm_calibrated = true;
+
+	if (getStringOption("SPM_HEURISTIC", NULL) == NULL)
+		__spm_heuristic = costHeuristic;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//thread placement (SPM_PLACEMENT): __spm_thread_lock takes a slot for the
+//thread in a per-node (and per-core) occupancy ledger, and
+//__spm_thread_unlock gives it back
+std::atomic<int>* __spm_node_threads;
+int* __spm_node_cores;
+bool __spm_placement_memory = false; //also weight nodes by free memory
+
+int __spm_num_cores;
+hwloc_bitmap_t* __spm_core_cpusets;
+int* __spm_core_node;
+std::atomic<int>* __spm_core_threads;
+
+std::atomic<unsigned> __spm_next_node(0);
+
+//a placement policy returns the node of a new thread, already counted in
+//the ledger, and sets Core to the core it was given (-1 for a whole node)
+typedef int (*PlacementFn)(int &Core);
+
+
+// Takes a slot in the node with the lowest threads/capacity ratio. The
+//choice is retried if another thread took a slot there meanwhile.
+static int leastLoadedNode(const std::vector<double> &Capacity) {
+	for (;;) {
+		int Best = -1, BestThreads = 0;
+		double BestLoad = 0;
+
+		for (int i=0; i<__spm_num_nodes; ++i) {
+			int Threads = __spm_node_threads[i].load(std::memory_order_relaxed);
+			double Load = (Threads + 1) / Capacity[i];
+
+			if (Best < 0 || Load < BestLoad) {
+				Best = i;
+				BestThreads = Threads;
+				BestLoad = Load;
+			}
+		}
+
+		if ( __spm_node_threads[Best].compare_exchange_weak(BestThreads, BestThreads + 1) )
+			return Best;
+	}
+}
+
+
+static std::vector<double> nodeCapacity() {
+	std::vector<double> Capacity(__spm_num_nodes);
+	for (int i=0; i<__spm_num_nodes; ++i)
+		Capacity[i] = __spm_node_cores[i];
+
+	if (__spm_placement_memory) {
+		std::vector<long> Free(__spm_num_nodes);
+		long MaxFree = 0;
+
+		for (int i=0; i<__spm_num_nodes; ++i)
+			MaxFree = std::max(MaxFree, Free[i] = __spm_monitor_running ? __spm_node_free[i].load() : nodeFreeMemory(i));
+
+		for (int i=0; i<__spm_num_nodes; ++i)
+			if (MaxFree > 0 && Free[i] >= 0)
+				Capacity[i] *= std::max(0.01, (double)Free[i] / MaxFree);
+	}
+
+	return Capacity;
+}
+
+
+// Least loaded node, relative to its cores (and free memory).
+static int balancePlacement(int &Core) {
+	Core = -1;
+	return leastLoadedNode( nodeCapacity() );
+}
+
+
+// Fills the nodes in order, one thread per core, then balances.
+static int packPlacement(int &Core) {
+	Core = -1;
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		int Threads = __spm_node_threads[i].load(std::memory_order_relaxed);
+
+		while (Threads < __spm_node_cores[i])
+			if ( __spm_node_threads[i].compare_exchange_weak(Threads, Threads + 1) )
+				return i;
+	}
+
+	return leastLoadedNode( nodeCapacity() );
+}
+
+
+// Gives every thread a core of its own while there are free cores, so
+//threads do not share SMT siblings; ties go to the least loaded node.
+static int spreadSmtPlacement(int &Core) {
+	if (__spm_num_cores == 0)
+		return balancePlacement(Core);
+
+	for (;;) {
+		int Best = -1, BestThreads = 0;
+
+		for (int c=0; c<__spm_num_cores; ++c) {
+			int Threads = __spm_core_threads[c].load(std::memory_order_relaxed);
+
+			if (Best < 0 || Threads < BestThreads || (Threads == BestThreads &&
+					__spm_node_threads[__spm_core_node[c]] < __spm_node_threads[__spm_core_node[Best]])) {
+				Best = c;
+				BestThreads = Threads;
+			}
+		}
+
+		if ( __spm_core_threads[Best].compare_exchange_weak(BestThreads, BestThreads + 1) ) {
+			Core = Best;
+			++__spm_node_threads[__spm_core_node[Best]];
+			return __spm_core_node[Best];
+		}
+	}
+}
+
+
+// Previous behaviour: nodes in turn, regardless of load.
+static int roundRobinPlacement(int &Core) {
+	Core = -1;
+
+	int Node = __spm_next_node++ % __spm_num_nodes;
+	++__spm_node_threads[Node];
+	return Node;
+}
+
+
+static const struct {
+	const char *Name;
+	PlacementFn Fn;
+} __spm_placements[] = {
+	{ "balance",     balancePlacement    },
+	{ "pack",        packPlacement       },
+	{ "spread-smt",  spreadSmtPlacement  },
+	{ "round-robin", roundRobinPlacement }
+};
+
+PlacementFn __spm_placement = balancePlacement;
+
+
+static void releasePlacement(ThreadContext &Ctx) {
+	if (Ctx.PlacedNode >= 0)
+		--__spm_node_threads[Ctx.PlacedNode];
+	if (Ctx.PlacedCore >= 0)
+		--__spm_core_threads[Ctx.PlacedCore];
+
+	Ctx.PlacedNode = Ctx.PlacedCore = -1;
+}
+
+
+static void setupPlacement() {
+	const char *Name = getStringOption("SPM_PLACEMENT", "balance");
+
+	__spm_placement = NULL;
+	for (size_t i=0; i<sizeof(__spm_placements)/sizeof(__spm_placements[0]); ++i)
+		if ( !strcmp(Name, __spm_placements[i].Name) )
+			__spm_placement = __spm_placements[i].Fn;
+
+	if (__spm_placement == NULL) {
+		fprintf(stderr, "SPM runtime: unknown placement %s, using balance\n", Name);
+		__spm_placement = balancePlacement;
+	}
+
+	__spm_placement_memory = getOption("SPM_PLACEMENT_MEMORY", 0) != 0;
+
+	__spm_node_threads = new std::atomic<int>[__spm_num_nodes];
+	__spm_node_cores = (int*)malloc(__spm_num_nodes*sizeof(int));
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		__spm_node_threads[i] = 0;
+		__spm_node_cores[i] = std::max(1, hwloc_get_nbobjs_inside_cpuset_by_type(__spm_topo,
+								__spm_node_cpusets[i], HWLOC_OBJ_CORE));
+	}
+
+	//cores outside every node are left out
+	int Cores = hwloc_get_nbobjs_by_type(__spm_topo, HWLOC_OBJ_CORE);
+	__spm_core_cpusets = (hwloc_bitmap_t*)malloc(std::max(Cores, 1)*sizeof(hwloc_bitmap_t));
+	__spm_core_node = (int*)malloc(std::max(Cores, 1)*sizeof(int));
+	__spm_core_threads = new std::atomic<int>[std::max(Cores, 1)];
+
+	__spm_num_cores = 0;
+	for (int i=0; i<Cores; ++i) {
+		hwloc_obj_t Obj = hwloc_get_obj_by_type(__spm_topo, HWLOC_OBJ_CORE, i);
+		int Cpu = hwloc_bitmap_first(Obj->cpuset);
+
+		if (Cpu < 0 || Cpu >= __spm_num_cpus || __spm_cpu_node[Cpu] < 0)
+			continue;
+
+		__spm_core_cpusets[__spm_num_cores] = hwloc_bitmap_dup(Obj->cpuset);
+		__spm_core_node[__spm_num_cores] = __spm_cpu_node[Cpu];
+		__spm_core_threads[__spm_num_cores] = 0;
+		++__spm_num_cores;
+	}
+
+	SPMR_DEBUG(std::cout << "Runtime: placement " << Name << ", " << __spm_num_cores << " cores\n");
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//moving the thread instead of the data (SPM_MOVE_THREAD=1)
+bool __spm_move_thread = false;
+long __spm_move_thread_min = MOVE_THREAD_MIN_BYTES;
+double __spm_rebind_ns = 20000;
+std::atomic<long> __spm_thread_moves(0);
+
+
+// Samples the node of up to SAMPLES pages spread over the range. Returns
+//the node holding most of them, or -1, and the fraction it holds.
+static int rangeOwner(long PageStart, long PageEnd, double &Fraction) {
+	const int SAMPLES = 64;
+	void *Pages[SAMPLES];
+	int PageStatus[SAMPLES];
+
+	long Stride = std::max(1L, (PageEnd - PageStart) / SAMPLES);
+	int N = 0;
+	for (long P = PageStart; P < PageEnd && N < SAMPLES; P += Stride)
+		Pages[N++] = (void*)(P << __spm_page_exp);
+
+	Fraction = 0;
+	if ( N == 0 || move_pages(0, N, Pages, NULL, PageStatus, 0) != 0 )
+		return -1;
+
+	std::vector<int> Count(__spm_num_nodes, 0);
+	int Owner = -1;
+	for (int i=0; i<N; ++i) {
+		int Node = (PageStatus[i] >= 0) ? nodeFromOsIndex(PageStatus[i]) : -1;
+		if (Node < 0)
+			continue;
+
+		if (__spm_shadow)
+			SPMRM.set((long)Pages[i] >> __spm_page_exp, ((long)Pages[i] >> __spm_page_exp) + 1, Node);
+
+		if (++Count[Node] > (Owner < 0 ? 0 : Count[Owner]))
+			Owner = Node;
+	}
+
+	if (Owner >= 0)
+		Fraction = (double)Count[Owner] / N;
+	return Owner;
+}
+
+
+// Decides whether the calling thread, on Node, should rather move to the
+//node that holds most of the range. Moving the thread costs a rebind plus,
+//if the other node is busier, the slowdown of the Reuse bytes it will read
+//there; moving the data costs migrating the part the other node holds.
+static int threadDestination(long PageStart, long PageEnd, long Reuse, int Node) {
+	long Bytes = (PageEnd - PageStart) << __spm_page_exp;
+	if (Bytes < __spm_move_thread_min)
+		return -1;
+
+	double Fraction;
+	int Owner = rangeOwner(PageStart, PageEnd, Fraction);
+	if (Owner < 0 || Owner == Node || Fraction < 0.5)
+		return -1;
+
+	double DataCost = migrationCost(Bytes) * Bytes * Fraction;
+
+	double OwnerLoad = (double)(__spm_node_threads[Owner] + 1) / __spm_node_cores[Owner];
+	double NodeLoad = (double)std::max(1, __spm_node_threads[Node].load()) / __spm_node_cores[Node];
+	double ThreadCost = __spm_rebind_ns + std::max(0.0, Reuse * __spm_local_ns * (OwnerLoad / NodeLoad - 1));
+
+	SPMR_DEBUG(std::cout << "Runtime: " << Fraction*100 << "% of the range on node " << Owner
+					   << ", moving data: " << DataCost << " ns, moving thread: " << ThreadCost << " ns\n");
+
+	return (ThreadCost < DataCost) ? Owner : -1;
+}
+
+
+// Takes a slot in the core of Node with the fewest threads. Returns the
+//core, or -1 if the node has none.
+static int leastLoadedCore(int Node) {
+	for (;;) {
+		int Best = -1, BestThreads = 0;
+
+		for (int c=0; c<__spm_num_cores; ++c) {
+			if (__spm_core_node[c] != Node)
+				continue;
+
+			int Threads = __spm_core_threads[c].load(std::memory_order_relaxed);
+			if (Best < 0 || Threads < BestThreads) {
+				Best = c;
+				BestThreads = Threads;
+			}
+		}
+
+		if ( Best < 0 || __spm_core_threads[Best].compare_exchange_weak(BestThreads, BestThreads + 1) )
+			return Best;
+	}
+}
+
+
+// Rebinds the calling thread, placed by __spm_thread_lock, to Node and moves
+//its slot in the placement ledger along: a thread that had a core of its
+//own gets the least loaded core of Node. __spm_thread_unlock unbinds it.
+static void moveThread(int Node) {
+	ThreadContext &Ctx = __spm_context;
+	bool OwnCore = Ctx.PlacedCore >= 0;
+
+	releasePlacement(Ctx);
+	++__spm_node_threads[Node];
+	Ctx.PlacedNode = Node;
+	Ctx.PlacedCore = OwnCore ? leastLoadedCore(Node) : -1;
+
+	hwloc_const_bitmap_t Cpuset = (Ctx.PlacedCore >= 0) ? __spm_core_cpusets[Ctx.PlacedCore]
+														: __spm_node_cpusets[Node];
+	hwloc_set_thread_cpubind(__spm_topo, (hwloc_thread_t)pthread_self(),
+		(hwloc_const_cpuset_t)Cpuset, HWLOC_CPUBIND_THREAD);
+
+	setContextNode(Ctx, Node);
+	Ctx.Cpu = sched_getcpu();
+	++__spm_thread_moves;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+//read-only replication: loops the pass proved to only read an array call
+//__spm_replicate, which gives each node its own copy of the range; loops
+//that write it call __spm_invalidate before and after running, and stale
+//copies are refreshed by the next __spm_replicate of their node. Freed
+//memory and, before every pthread_create, all memory is invalidated too.
+//Copies live until __spm_end.
+bool __spm_replication = true;
+std::atomic<long> __spm_replicas(0);
+std::atomic<long> __spm_replica_bytes(0);
+std::atomic<long> __spm_replica_refreshes(0);
+std::atomic<long> __spm_replica_invalidations(0);
+std::atomic<long> __spm_replica_declined(0);
+
+struct Replica {
+	long PageStart, PageEnd;
+	pthread_mutex_t Lock;    //taken to make or refresh a copy
+	std::atomic<long> Version;
+	std::atomic<char*> *Copies; //per node; the original itself on its own node
+	std::atomic<long> *Versions; //per node, of the data in Copies
+};
+
+class ReplicaTable {
+public:
+	ReplicaTable() : Count_(0) {
+		pthread_rwlock_init(&Lock_, NULL);
+	}
+
+	// The replica holding [PageStart, PageEnd), made if no replica overlaps
+	//the range; NULL if another one does.
+	Replica *get(long PageStart, long PageEnd) {
+		pthread_rwlock_rdlock(&Lock_);
+		Replica *R = find(PageStart, PageEnd);
+		pthread_rwlock_unlock(&Lock_);
+
+		if (R && R->PageStart <= PageStart && PageEnd <= R->PageEnd)
+			return R;
+		if (R)
+			return NULL;
+
+		pthread_rwlock_wrlock(&Lock_);
+		R = find(PageStart, PageEnd);
+		if (R == NULL) {
+			R = new Replica;
+			R->PageStart = PageStart;
+			R->PageEnd = PageEnd;
+			pthread_mutex_init(&R->Lock, NULL);
+			R->Version.store(0, std::memory_order_relaxed);
+			R->Copies = new std::atomic<char*>[__spm_num_nodes]();
+			R->Versions = new std::atomic<long>[__spm_num_nodes]();
+			Map_[PageStart] = R;
+			Count_.store(Map_.size(), std::memory_order_release);
+		}
+		pthread_rwlock_unlock(&Lock_);
+
+		return (R->PageStart <= PageStart && PageEnd <= R->PageEnd) ? R : NULL;
+	}
+
+	// Marks every copy of pages in [PageStart, PageEnd) stale. Called twice
+	//per writing loop, so that a copy refreshed while it ran, with only part
+	//of its writes, does not carry the final version.
+	void invalidate(long PageStart, long PageEnd) {
+		if ( Count_.load(std::memory_order_acquire) == 0 )
+			return;
+
+		pthread_rwlock_rdlock(&Lock_);
+		for (auto It = Map_.begin(); It != Map_.end() && It->first < PageEnd; ++It)
+			if (It->second->PageEnd > PageStart) {
+				++It->second->Version;
+				++__spm_replica_invalidations;
+			}
+		pthread_rwlock_unlock(&Lock_);
+	}
+
+	bool empty() {
+		return Count_.load(std::memory_order_acquire) == 0;
+	}
+
+	void clear() {
+		for (auto &Entry : Map_) {
+			Replica *R = Entry.second;
+			long Len = (R->PageEnd - R->PageStart) << __spm_page_exp;
+
+			for (int i=0; i<__spm_num_nodes; ++i) {
+				char *Copy = R->Copies[i].load(std::memory_order_relaxed);
+				if (Copy && Copy != (char*)(R->PageStart << __spm_page_exp))
+					munmap(Copy, Len);
+			}
+
+			pthread_mutex_destroy(&R->Lock);
+			delete[] R->Copies;
+			delete[] R->Versions;
+			delete R;
+		}
+		Map_.clear();
+		Count_.store(0, std::memory_order_release);
+	}
+
+private:
+	Replica *find(long PageStart, long PageEnd) {
+		auto It = Map_.lower_bound(PageEnd);
+		if (It == Map_.begin())
+			return NULL;
+		--It;
+		return It->second->PageEnd > PageStart ? It->second : NULL;
+	}
+
+	pthread_rwlock_t Lock_;
+	std::map<long, Replica*> Map_; //by first page
+	std::atomic<long> Count_;
+};
+
+static ReplicaTable SPMRT;
+
+
+// Tells whether every page of the range is populated and on the node,
+//querying them in batches of __spm_batch_pages.
+static bool rangeOnNode(long PageStart, long PageEnd, int Node) {
+	const int Target = __spm_node_os_index[Node];
+	std::vector<void*> Pages;
+	std::vector<int> PageStatus(__spm_batch_pages);
+
+	for (long P = PageStart; P < PageEnd; P += __spm_batch_pages) {
+		long N = std::min(__spm_batch_pages, PageEnd - P);
+
+		Pages.clear();
+		for (long i=0; i<N; ++i)
+			Pages.push_back( (void*)((P + i) << __spm_page_exp) );
+
+		if ( move_pages(0, N, Pages.data(), NULL, PageStatus.data(), 0) != 0 )
+			return false;
+
+		for (long i=0; i<N; ++i)
+			if (PageStatus[i] != Target)
+				return false;
+	}
+
+	return true;
+}
+
+
+// The copy of the replica on the node, made or refreshed as needed; NULL if
+//the node has no room for it.
+static char *replicaOn(Replica *R, int Node, SiteStats *Site) {
+	char *Original = (char*)(R->PageStart << __spm_page_exp);
+	long Len = (R->PageEnd - R->PageStart) << __spm_page_exp;
+
+	char *Copy = R->Copies[Node].load(std::memory_order_acquire);
+	if ( Copy && (Copy == Original || R->Versions[Node].load(std::memory_order_acquire)
+										  == R->Version.load(std::memory_order_acquire)) )
+		return Copy;
+
+	pthread_mutex_lock(&R->Lock);
+
+	long Version = R->Version.load(std::memory_order_acquire);
+	bool Fill = false;
+
+	Copy = R->Copies[Node].load(std::memory_order_relaxed);
+	if (Copy == NULL) {
+		if ( rangeOnNode(R->PageStart, R->PageEnd, Node) )
+			Copy = Original;
+		else {
+			long Free = __spm_min_free > 0 ? __spm_node_free[Node].load(std::memory_order_relaxed) : -1;
+
+			if ( Free < 0 || Free - Len >= __spm_min_free )
+				Copy = mapStaging((long)Original, Len, Node, Len >= __spm_hpage_size);
+
+			if (Copy == NULL) {
+				pthread_mutex_unlock(&R->Lock);
+				return NULL;
+			}
+
+			if (__spm_min_free > 0)
+				__spm_node_free[Node] -= Len;
+
+			++__spm_replicas;
+			__spm_replica_bytes += Len;
+			Fill = true;
+		}
+	}
+	else if (Copy != Original && R->Versions[Node].load(std::memory_order_relaxed) != Version) {
+		++__spm_replica_refreshes;
+		Fill = true;
+	}
+
+	if (Fill) {
+		SPMR_DEBUG(std::cout << "Runtime: copying pages " << R->PageStart << " to " << R->PageEnd
+						   << " to node " << Node << "\n");
+
+		long Start = nowNs();
+		splitAmongHelpers(NULL, R->PageStart, R->PageEnd, Node, Site, Copy);
+		if (Site)
+			Site->KernelNs += nowNs() - Start;
+
+		R->Versions[Node].store(Version, std::memory_order_release);
+	}
+
+	R->Copies[Node].store(Copy, std::memory_order_release);
+
+	pthread_mutex_unlock(&R->Lock);
+	return Copy;
+}
+
+
+/* ***************************************************************** */
+/* ***************************************************************** */
+
+static void writeString(std::ostream &OS, const char *Str) {
+	OS << '"';
+	for (; Str && *Str; ++Str) {
+		if (*Str == '"' || *Str == '\\')
+			OS << '\\' << *Str;
+		else if ((unsigned char)*Str >= 0x20)
+			OS << *Str;
+	}
+	OS << '"';
+}
+
+
+static std::string errnoName(int Err) {
+	switch (Err) {
+	case EPERM:  return "EPERM";
+	case ENOENT: return "ENOENT";
+	case EIO:    return "EIO";
+	case EAGAIN: return "EAGAIN";
+	case ENOMEM: return "ENOMEM";
+	case EACCES: return "EACCES";
+	case EFAULT: return "EFAULT";
+	case EBUSY:  return "EBUSY";
+	case ENODEV: return "ENODEV";
+	case EINVAL: return "EINVAL";
+	case ENOSYS: return "ENOSYS";
+	default:     return "errno_" + std::to_string(Err);
+	}
+}
+
+
+// Writes the run statistics as JSON to the file named by SPM_STATS ("-" for
+//stderr): global page counters plus one entry per call site.
+static void dumpStats() {
+	const char *Name = getStringOption("SPM_STATS", NULL);
+	if (Name == NULL || *Name == '\0')
+		return;
+
+	std::ofstream File;
+	if ( strcmp(Name, "-") ) {
+		File.open(Name);
+		if (!File) {
+			fprintf(stderr, "SPM runtime: could not write statistics to %s\n", Name);
+			return;
+		}
+	}
+	std::ostream &OS = File.is_open() ? File : std::cerr;
+
+	OS << "{\n"
+	   << "  \"pages\": { \"moved\": " << __spm_pages_moved << ", \"local\": " << __spm_pages_local
+	   << ", \"busy\": " << __spm_pages_busy << ", \"failed\": " << __spm_pages_failed << " },\n"
+	   << "  \"shadow\": { \"checks\": " << __spm_shadow_checks << ", \"drift\": " << __spm_shadow_drift << " },\n"
+	   << "  \"thread_moves\": " << __spm_thread_moves << ",\n"
+	   << "  \"released_pages\": " << __spm_released_pages << ",\n"
+	   << "  \"chunked_migrations\": " << __spm_chunked_migrations << ",\n"
+	   << "  \"parallel_migrations\": " << __spm_parallel_migrations << ",\n"
+	   << "  \"remap\": { \"remapped\": " << __spm_remapped << ", \"fallbacks\": " << __spm_remap_fallbacks << " },\n"
+	   << "  \"replication\": { \"replicas\": " << __spm_replicas << ", \"bytes\": " << __spm_replica_bytes
+	   << ", \"refreshes\": " << __spm_replica_refreshes << ", \"invalidations\": " << __spm_replica_invalidations
+	   << ", \"declined\": " << __spm_replica_declined << " },\n"
+	   << "  \"retries\": " << __spm_retried << ",\n"
+	   << "  \"fallbacks\": " << __spm_fallbacks << ",\n"
+	   << "  \"pressure\": { \"shrunk\": " << __spm_pressure_shrunk << ", \"redirected\": "
+	   << __spm_pressure_redirected << ", \"refused\": " << __spm_pressure_refused << " },\n"
+	   << "  \"errors\": {";
+
+	const char *Sep = " ";
+	for (int i=0; i<ERRNO_SLOTS; ++i) {
+		if (__spm_errors[i] == 0)
+			continue;
+		OS << Sep << '"' << errnoName(i) << "\": " << __spm_errors[i];
+		Sep = ", ";
+	}
+
+	OS << " },\n"
+	   << "  \"interleave\": { \"ranges\": " << __spm_interleaved << ", \"hits\": " << __spm_interleave_hits
+	   << ", \"arrays\": [";
+
+	Sep = "\n";
+	SPMCT.forEach([&](const ContentionTracker::Interleaving &I) {
+		OS << Sep << "    { \"array\": ";
+		writeString(OS, I.Info ? I.Info->Array : "");
+		OS << ", \"address\": " << I.Ary << ", \"bytes\": " << ((I.PageEnd - I.PageStart) << __spm_page_exp)
+		   << ", \"nodes\": [";
+		const char *NodeSep = "";
+		for (int i=0; i<__spm_num_nodes; ++i)
+			if (I.Nodes[i]) {
+				OS << NodeSep << i;
+				NodeSep = ", ";
+			}
+		OS << "] }";
+		Sep = ",\n";
+	});
+
+	OS << (Sep[0] == ',' ? "\n  ] },\n" : "] },\n")
+	   << "  \"sites\": [";
+
+	bool First = true;
+	SPMST.forEach([&](SiteStats &S) {
+		const SiteInfo *Info = S.Info.load(std::memory_order_acquire);
+
+		OS << (First ? "\n" : ",\n") << "    { \"id\": " << S.Key - 1;
+		if (Info) {
+			OS << ", \"function\": "; writeString(OS, Info->Function);
+			OS << ", \"loop\": ";     writeString(OS, Info->Loop);
+			OS << ", \"file\": ";     writeString(OS, Info->File);
+			OS << ", \"line\": " << Info->Line;
+			OS << ", \"array\": ";    writeString(OS, Info->Array);
+		}
+		OS << ", \"calls\": " << S.Calls << ", \"accepted\": " << S.Accepted
+		   << ", \"rejected\": " << S.Rejected << ", \"bytes_migrated\": " << S.Bytes
+		   << ", \"kernel_ns\": " << S.KernelNs << ", \"skipped\": " << S.Skipped
+		   << ", \"probes\": " << S.Probes << ", \"disabled\": " << (S.Disabled ? "true" : "false")
+		   << ", \"thread_moves\": " << S.ThreadMoves << " }";
+		First = false;
+	});
+
+	OS << "\n  ]\n}\n";
+}
+
+
+void __spm_init() {
+  SPMR_DEBUG(std::cout << "Runtime: initialize\n");
+
+  loadConfig();
+
+	__spm_page_size = sysconf(_SC_PAGESIZE);
+	for (__spm_page_exp = 0; (1L << __spm_page_exp) < __spm_page_size; ++__spm_page_exp);
+
+	std::ifstream HugePageSize("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+	if ( !(HugePageSize >> __spm_hpage_size) || __spm_hpage_size <= __spm_page_size )
+		__spm_hpage_size = 2L << 20;
+
+  hwloc_topology_init(&__spm_topo);
+  hwloc_topology_load(__spm_topo);
+
+  hwloc_obj_t obj;
+  for (obj = hwloc_get_obj_by_type(__spm_topo, HWLOC_OBJ_PU, 0); obj;
+       obj = obj->parent)
+    if (obj->type == HWLOC_OBJ_CACHE)
+      __spm_cache_size += obj->attr->cache.size;
+
+	__spm_full_cpuset = hwloc_bitmap_alloc();
+	hwloc_get_cpubind(__spm_topo, __spm_full_cpuset, HWLOC_CPUBIND_PROCESS);
+
+////////////////////////////////////////////////////////////////////////
+	__spm_num_nodes = hwloc_get_nbobjs_by_type (__spm_topo, HWLOC_OBJ_NODE);
+	if (__spm_num_nodes <= 0) {
+		fprintf(stderr, "SPM runtime: hwloc reports no NUMA nodes\n");
+		exit(99);
+	}
+
+	__spm_nodes = (hwloc_bitmap_t*)malloc(__spm_num_nodes*sizeof(hwloc_bitmap_t));
+	__spm_node_cpusets = (hwloc_bitmap_t*)malloc(__spm_num_nodes*sizeof(hwloc_bitmap_t));
+	__spm_node_os_index = (int*)malloc(__spm_num_nodes*sizeof(int));
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		obj = hwloc_get_obj_by_type (__spm_topo, HWLOC_OBJ_NODE, i);
+		__spm_nodes[i] = hwloc_bitmap_alloc();
+		hwloc_bitmap_copy(__spm_nodes[i], obj->nodeset);
+
+		__spm_node_cpusets[i] = hwloc_bitmap_alloc();
+		hwloc_cpuset_from_nodeset(__spm_topo, __spm_node_cpusets[i], __spm_nodes[i]);
+		__spm_node_os_index[i] = obj->os_index;
+	}
+
+	__spm_num_cpus = 0;
+	for (int i=0; i<__spm_num_nodes; ++i)
+		__spm_num_cpus = std::max(__spm_num_cpus, hwloc_bitmap_last(__spm_node_cpusets[i]) + 1);
+
+	__spm_cpu_node = (int*)malloc(std::max(__spm_num_cpus, 1)*sizeof(int));
+	std::fill(__spm_cpu_node, __spm_cpu_node + __spm_num_cpus, -1);
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		unsigned Cpu;
+		hwloc_bitmap_foreach_begin(Cpu, __spm_node_cpusets[i])
+			__spm_cpu_node[Cpu] = i;
+		hwloc_bitmap_foreach_end();
+	}
+
+////////////////////////////////////////////////////////////////////////
+	__spm_node_allowed = (bool*)malloc(__spm_num_nodes*sizeof(bool));
+	refreshAllowedNodes();
+	__spm_distances = getDistances();
+
+	const char *Pressure = getStringOption("SPM_PRESSURE", "shrink");
+	if ( !strcmp(Pressure, "redirect") )
+		__spm_pressure = SPM_PRESSURE_REDIRECT;
+	else if ( !strcmp(Pressure, "refuse") )
+		__spm_pressure = SPM_PRESSURE_REFUSE;
+
+	__spm_min_free = getOption("SPM_MIN_FREE_MB", MIN_FREE_MB) << 20;
+	__spm_free_refresh = std::max(1L, getOption("SPM_FREE_REFRESH_MS", FREE_REFRESH_MS));
+	startMemoryMonitor();
+
+	__spm_retries = getOption("SPM_RETRIES", RETRIES);
+	__spm_retry_us = getOption("SPM_RETRY_US", RETRY_US);
+
+	setupHeuristic();
+	setupPlacement();
+
+	const char *Backend = getStringOption("SPM_BACKEND", "hwloc");
+	if ( !strcmp(Backend, "move_pages") )
+		__spm_backend = SPM_BACKEND_MOVE_PAGES;
+	else if ( !strcmp(Backend, "remap") )
+		__spm_backend = SPM_BACKEND_REMAP;
+
+	__spm_remap_bytes = getOption("SPM_REMAP_BYTES", REMAP_BYTES);
+
+	if (const char *Sites = getStringOption("SPM_REMAP_SITES", NULL)) {
+		for (char *End; *Sites; Sites = (*End == ',') ? End + 1 : End) {
+			long Id = strtol(Sites, &End, 0);
+			if (End == Sites)
+				break;
+			if (SiteStats *S = SPMST.get(Id))
+				S->Remap = true;
+		}
+	}
+
+	__spm_batch_pages = getOption("SPM_BATCH_PAGES", BATCH_PAGES);
+	if (__spm_batch_pages < 1)
+		__spm_batch_pages = BATCH_PAGES;
+
+	__spm_registry = getOption("SPM_REGISTRY", 1) != 0;
+	__spm_min_residency = getOption("SPM_MIN_RESIDENCY_US", RESIDENCY_US);
+
+	__spm_release_enabled = getOption("SPM_RELEASE", 0) != 0;
+	__spm_release_cold = getOption("SPM_RELEASE_COLD", 0) != 0;
+
+	__spm_interleave = getOption("SPM_INTERLEAVE", 0);
+	__spm_interleave_us = getOption("SPM_INTERLEAVE_US", INTERLEAVE_US);
+	if (__spm_interleave == 1 || __spm_interleave > __spm_num_nodes)
+		__spm_interleave = 0; //one node cannot contend, nor more than there are
+
+	__spm_thp = getOption("SPM_THP", 1) != 0;
+	__spm_madvise_huge = getOption("SPM_MADVISE_HUGEPAGE", 0) != 0;
+	__spm_smaps_refresh = getOption("SPM_SMAPS_REFRESH_US", SMAPS_REFRESH_US);
+
+	__spm_shadow = getOption("SPM_SHADOW", 1) != 0;
+	__spm_shadow_validate = getOption("SPM_SHADOW_VALIDATE", 0);
+
+	if ( getOption("SPM_CALIBRATE", 0) != 0 )
+		setupCalibration();
+
+	__spm_move_thread = getOption("SPM_MOVE_THREAD", 0) != 0;
+	__spm_move_thread_min = getOption("SPM_MOVE_THREAD_MIN_BYTES", MOVE_THREAD_MIN_BYTES);
+	__spm_rebind_ns = getFloatOption("SPM_REBIND_NS", __spm_rebind_ns);
+
+	__spm_adaptive = getOption("SPM_ADAPTIVE", 0) != 0;
+	__spm_adaptive_samples = std::max(1L, getOption("SPM_ADAPTIVE_SAMPLES", ADAPTIVE_SAMPLES));
+	__spm_adaptive_period = std::max(1L, getOption("SPM_ADAPTIVE_PERIOD", ADAPTIVE_PERIOD));
+	__spm_adaptive_margin = getFloatOption("SPM_ADAPTIVE_MARGIN", 0.05);
+
+	__spm_chunked = getOption("SPM_CHUNKED", 0) != 0;
+	__spm_chunk_bytes = getOption("SPM_CHUNK_BYTES", CHUNK_BYTES);
+
+	__spm_num_helpers = std::max(0L, getOption("SPM_HELPERS", 0));
+	__spm_parallel_bytes = getOption("SPM_PARALLEL_BYTES", PARALLEL_BYTES);
+
+	__spm_replication = getOption("SPM_REPLICATE", 1) != 0;
+
+	__spm_async = getOption("SPM_ASYNC", 0) != 0;
+	startWorkers();
+}
+
+
+void __spm_end() {
+	SPMR_DEBUG(std::cout << "Runtime: end\n");
+	//printf("\n\ncount=%lu\n",count);
+
+	stopWorkers();
+
+	stopMemoryMonitor();
+	SPMRT.clear();
+	dumpStats();
+
+	hwloc_bitmap_free(__spm_full_cpuset);
+
+	SPMR_DEBUG(std::cout << "Runtime: pages moved: " << __spm_pages_moved
+					   << ", local: " << __spm_pages_local << ", busy: "
+					   << __spm_pages_busy << ", failed: " << __spm_pages_failed
+					   << "\n");
+	SPMR_DEBUG(std::cout << "Runtime: shadow map checks: " << __spm_shadow_checks
+					   << ", drift: " << __spm_shadow_drift << "\n");
+
+	for (int i=0; i<__spm_num_nodes; ++i) {
+		hwloc_bitmap_free(__spm_nodes[i]);
+		hwloc_bitmap_free(__spm_node_cpusets[i]);
+	}
+	free(__spm_nodes);
+	free(__spm_node_cpusets);
+	free(__spm_node_os_index);
+	free(__spm_cpu_node);
+	free(__spm_node_allowed);
+	delete[] __spm_distances;
+
+	for (int i=0; i<__spm_num_cores; ++i)
+		hwloc_bitmap_free(__spm_core_cpusets[i]);
+	free(__spm_core_cpusets);
+	free(__spm_core_node);
+	free(__spm_node_cores);
+	delete[] __spm_core_threads;
+	delete[] __spm_node_threads;
+
+	delete[] __spm_read_ns;
+	delete[] __spm_penalty_ns;
+
+	hwloc_topology_destroy(__spm_topo);
+/*
+	print_log(&page_log);
+	clear_map(&page_log);
+*/
+}
+
+
+void __spm_thread_lock() {
+	ThreadContext &Ctx = __spm_context;
+	releasePlacement(Ctx); //locked twice without unlocking
+
+	int Core;
+	int k = __spm_placement(Core);
+
+	hwloc_const_bitmap_t Cpuset = (Core >= 0) ? __spm_core_cpusets[Core] : __spm_node_cpusets[k];
+	hwloc_set_thread_cpubind(__spm_topo, (hwloc_thread_t)pthread_self(), (hwloc_const_cpuset_t)Cpuset, HWLOC_CPUBIND_THREAD);
+
+	SPMR_DEBUG(std::cout << "Runtime: thread placed on node " << k << ", core " << Core
+					   << " (" << __spm_node_threads[k] << " threads on the node)\n");
+
+	setContextNode(Ctx, k);
+	Ctx.PlacedNode = k;
+	Ctx.PlacedCore = Core;
+	Ctx.Cpu = sched_getcpu();
+}
+
+
+void __spm_thread_unlock() {
+
+	hwloc_set_thread_cpubind(__spm_topo, (hwloc_thread_t)pthread_self(), (hwloc_const_cpuset_t)__spm_full_cpuset, HWLOC_CPUBIND_THREAD);
+
+	ThreadContext &Ctx = __spm_context;
+	releasePlacement(Ctx);
+	Ctx.Cpu = -1; //may be scheduled anywhere from now on
+}
+
+
+void __spm_register_sites(const void *Sites, long NumSites) {
+	SPMST.describe((const SiteInfo*)Sites, NumSites);
+}
+
+
+void __spm_loop_begin(long SiteId) {
+	if (!__spm_adaptive)
+		return;
+
+	SiteStats *Site = SPMST.get(SiteId);
+	if (Site == NULL)
+		return;
+
+	long Run = Site->Runs++;
+	long Probe = Site->ProbeStart.load(std::memory_order_relaxed);
+	bool Probing = Run >= Probe;
+	bool Migrate = !Site->Disabled.load(std::memory_order_relaxed);
+
+	if (Probing) {
+		Migrate = (probeRun(Site, Probe) & 1) != 0;
+
+		//samples without migration are dropped when the range is local already;
+		//when that keeps happening there is nothing left to compare
+		if ( Site->Samples++ >= 8*__spm_adaptive_samples ) {
+			closeProbe(Site, Probe, std::min(Site->Backoff.load() + 1, 6));
+			Probing = false;
+			Migrate = !Site->Disabled.load(std::memory_order_relaxed);
+		}
+	}
+
+	LoopTimer T = { Site, nowNs(), Migrate, Probing, Probe };
+	__spm_context.Timers.push_back(T);
+}
+
+
+void __spm_loop_end(long SiteId) {
+	if (!__spm_adaptive)
+		return;
+
+	std::vector<LoopTimer> &Timers = __spm_context.Timers;
+
+	//the exit block may also be reached without passing the preheader, so
+	//an end without a matching begin is ignored
+	for (size_t i = Timers.size(); i-- > 0; ) {
+		if (Timers[i].Site->Key.load(std::memory_order_relaxed) != SiteId + 1)
+			continue;
+
+		LoopTimer T = Timers[i];
+		Timers.resize(i); //also drops inner timers that never ended
+
+		if (T.Probe)
+			recordProbe(T.Site, T.ProbeStart, T.Migrate, nowNs() - T.Start);
+		return;
+	}
+}
+
+
+void __spm_get(void *Ary, long Start, long End, long Reuse, long SiteId) {
+
+	SPMR_DEBUG(std::cout << "Runtime: get page for: " << (long unsigned)Ary
+		<< ", " << Start << ", " << End << ", "
+		<< Reuse << " (site " << SiteId << ")\n");
+
+	SiteStats *Site = SPMST.get(SiteId);
+	if (Site)
+		++Site->Calls;
+
+	long PageStart = ((long)Ary + Start)/__spm_page_size;
+	long PageEnd   = ((long)Ary + End)/__spm_page_size;
+
+
+	//printf("\n\nReuse=%ld, Start=%ld, End=%ld",Reuse,PageStart,PageEnd);
+
+	int Node = currentNode();
+
+	if ( __spm_heuristic(End - Start, Reuse, Node) ) {
+
+		if (Site)
+			++Site->Accepted;
+
+		LoopTimer *Timer = __spm_adaptive && Site ? loopTimer(Site) : NULL;
+		bool Probe = Timer && Timer->Probe;
+
+		if ( __spm_adaptive && Site && !migrationAllowed(Site) ) {
+			//a sample without migration only counts if the range is not local
+			//already, e.g. moved by an earlier execution that migrated
+			if ( Probe && validateResidency(PageStart, PageEnd, Node) )
+				Timer->Probe = false;
+
+			++Site->Skipped;
+			SPMR_DEBUG(std::cout << "Runtime: site " << SiteId << " disabled, not migrating\n");
+			return;
+		}
+
+		//printf("\n\nExpr=%lf",(double)Reuse/(double)( (PageEnd - PageStart) * __spm_page_size ));
+		//printf("\n\nExpr=%lu",(End-Start));
+		//printf("\nMIGROU\n");
+
+		if ( __spm_interleave > 0 && SPMCT.contended(Ary, PageStart, PageEnd, Node, now(),
+				Site ? Site->Info.load(std::memory_order_relaxed) : NULL) ) {
+			SPMR_DEBUG(std::cout << "Runtime: pages " << PageStart << " to " << PageEnd << " interleaved\n");
+			return;
+		}
+
+		//only threads __spm_thread_lock placed, whose binding it undoes
+		if (__spm_move_thread && __spm_context.PlacedNode >= 0) {
+			int Dest = threadDestination(PageStart, PageEnd, Reuse, Node);
+
+			if (Dest >= 0) {
+				SPMR_DEBUG(std::cout << "Runtime: moving thread from node " << Node << " to " << Dest << "\n");
+				moveThread(Dest);
+				if (Site)
+					++Site->ThreadMoves;
+				Node = Dest; //the pages not there yet still follow
+			}
+		}
+
+		//probe executions that migrate go to the kernel: the registry and the
+		//shadow map would skip ranges moved for an earlier execution
+		bool Foreign = true; //unknown without the registry
+
+		if (__spm_registry && !Probe) {
+			PageIntervals::Verdict V = SPMPI.acquire(Ary, PageStart, PageEnd, Node, now(), &Foreign);
+
+			if (V != PageIntervals::MIGRATE) {
+				SPMR_DEBUG(std::cout << "Runtime: pages " << PageStart << " to " << PageEnd
+					<< (V == PageIntervals::OWNED ? " already owned by node " : " recently migrated, not moving to node ")
+					<< Node << "\n");
+				return;
+			}
+		}
+
+		if ( __spm_shadow && !Probe && SPMRM.isLocal(PageStart, PageEnd, Node) ) {
+			long Check = ++__spm_shadow_checks;
+
+			if ( __spm_shadow_validate <= 0 || Check % __spm_shadow_validate != 0
+					|| validateResidency(PageStart, PageEnd, Node) ) {
+				SPMR_DEBUG(std::cout << "Runtime: pages " << PageStart << " to " << PageEnd
+					<< " already on node " << Node << "\n");
+				return;
+			}
+		}
+
+		const SiteInfo *Info = Site ? Site->Info.load(std::memory_order_relaxed) : NULL;
+
+		if ( __spm_chunked && Info && Info->Direction != 0
+				&& ((PageEnd - PageStart) << __spm_page_exp) > __spm_chunk_bytes )
+			return migrateChunked(Ary, PageStart, PageEnd, Node, Info->Direction, Site);
+
+		if ( __spm_async && enqueueMigration(Ary, PageStart, PageEnd, Node, Site) )
+			return;
+
+		//the remap copy would lose writes made meanwhile by threads of other
+		//nodes, so it is only used for sites that opted in, on ranges no
+		//other node held
+		if ( __spm_backend == SPM_BACKEND_REMAP && Site && Site->Remap.load(std::memory_order_relaxed)
+				&& !Foreign && migrateRemap(Ary, (long)Ary + Start, (long)Ary + End, Node, Site) )
+			return;
+
+		if ( __spm_num_helpers > 0 && ((PageEnd - PageStart) << __spm_page_exp) >= __spm_parallel_bytes )
+			return migrateParallel(Ary, PageStart, PageEnd, Node, Site);
+
+		//the registry only keeps what actually moved
+		if ( !migrate(PageStart, PageEnd, Node, Site) )
+			disown(Ary, PageStart, PageEnd, Node);
+
+	}//heuristic
+	else if (Site)
+		++Site->Rejected;
+
+}
+
+
+// Returns a pointer to use instead of Ary for reads of [Start, End) by the
+//calling thread: Ary itself, or the address Ary has in the node's replica.
+//Where replication does not apply this is __spm_get.
+void *__spm_replicate(void *Ary, long Start, long End, long Reuse, long SiteId) {
+
+	SPMR_DEBUG(std::cout << "Runtime: replicate: " << (long unsigned)Ary
+		<< ", " << Start << ", " << End << ", "
+		<< Reuse << " (site " << SiteId << ")\n");
+
+	if (!__spm_replication || __spm_num_nodes < 2) {
+		__spm_get(Ary, Start, End, Reuse, SiteId);
+		return Ary;
+	}
+
+	SiteStats *Site = SPMST.get(SiteId);
+	if (Site)
+		++Site->Calls;
+
+	int Node = currentNode();
+
+	if ( !__spm_heuristic(End - Start, Reuse, Node) ) {
+		if (Site)
+			++Site->Rejected;
+		return Ary;
+	}
+
+	if (Site)
+		++Site->Accepted;
+
+	long PageStart = ((long)Ary + Start) >> __spm_page_exp;
+	long PageEnd   = ((long)Ary + End + __spm_page_size - 1) >> __spm_page_exp;
+
+	Replica *R = SPMRT.get(PageStart, PageEnd);
+	char *Copy = R ? replicaOn(R, Node, Site) : NULL;
+
+	if (Copy == NULL) {
+		++__spm_replica_declined;
+		__spm_get(Ary, Start, End, Reuse, SiteId);
+		return Ary;
+	}
+
+	return Copy + ((long)Ary - (R->PageStart << __spm_page_exp));
+}
+
+
+// Called at the exit of the loop a __spm_get was made for, with its range.
+void __spm_release(void *Ary, long Start, long End) {
+	if (!__spm_release_enabled)
+		return;
+
+	long PageStart = ((long)Ary + Start)/__spm_page_size;
+	long PageEnd   = ((long)Ary + End)/__spm_page_size;
+	int Node = currentNode();
+
+	SPMR_DEBUG(std::cout << "Runtime: release pages " << PageStart << " to " << PageEnd
+					   << " (node " << Node << ")\n");
+
+	if (__spm_registry)
+		__spm_released_pages += SPMPI.release(Ary, PageStart, PageEnd, Node);
+
+	if (__spm_interleave > 0)
+		SPMCT.release(Ary, Node);
+
+#ifdef MADV_COLD
+	if (__spm_release_cold && PageEnd > PageStart)
+		madvise((void*)(PageStart << __spm_page_exp), (PageEnd - PageStart) << __spm_page_exp, MADV_COLD);
+#endif
+}
+
+
+// Forgets what the runtime knows of the Bytes bytes at Ary, to be called
+//before they are unmapped or reused for other data: their residency in the
+//shadow map and which node owns them in the registry; their copies are
+//marked stale. Ary must be the array as the transformed loops use it.
+void __spm_forget(void *Ary, long Bytes) {
+	long PageStart = (long)Ary >> __spm_page_exp;
+	long PageEnd   = ((long)Ary + Bytes + __spm_page_size - 1) >> __spm_page_exp;
+
+	SPMR_DEBUG(std::cout << "Runtime: forget pages " << PageStart << " to " << PageEnd << "\n");
+
+	if (__spm_shadow)
+		SPMRM.forget(PageStart, PageEnd);
+
+	if (__spm_registry)
+		SPMPI.release(Ary, PageStart, PageEnd, -1);
+
+	SPMRT.invalidate(PageStart, PageEnd);
+}
+
+
+// Called by the pass before free, realloc and delete of Block, a heap block
+//from malloc. Blocks smaller than a page live in pages the allocator keeps,
+//so what the runtime knows of those pages stays true.
+void __spm_forget_block(void *Block) {
+	if (!__spm_registry && !__spm_shadow && SPMRT.empty())
+		return;
+
+	long Bytes = Block ? malloc_usable_size(Block) : 0;
+
+	if (Bytes >= __spm_page_size)
+		__spm_forget(Block, Bytes);
+}
+
+
+// Called before loops that write [Start, End) of Ary.
+void __spm_invalidate(void *Ary, long Start, long End) {
+	SPMRT.invalidate(((long)Ary + Start) >> __spm_page_exp,
+					 ((long)Ary + End + __spm_page_size - 1) >> __spm_page_exp);
+}
 
-	}//heuristic
 
+// Called before every pthread_create: the threads about to start may read
+//arrays that the program wrote since the copies were made.
+void __spm_invalidate_all() {
+	SPMRT.invalidate(0, std::numeric_limits<long>::max());
 }
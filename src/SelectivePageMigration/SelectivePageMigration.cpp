@@ -24,12 +24,21 @@
 #include "SelectivePageMigration.h"
 
 #include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/DebugInfo.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/CallSite.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
+#include <algorithm>
 #include <vector>
 #include <set>
 #include <string>
@@ -47,6 +56,22 @@ static cl::opt<bool>	ClThreadLock( "spm-thread-lock", cl::desc("Enable thread-lo
 						cl::Hidden, cl::init(false) );
 
 
+static cl::opt<bool>	ClReplicate( "spm-replicate", cl::desc("Replicate arrays that loops only read on every node that reads them"),
+						cl::Hidden, cl::init(false) );
+
+
+static cl::opt<bool>	ClAdaptive( "spm-adaptive", cl::desc("Time the loops of each call site for the runtime's adaptive mode (SPM_ADAPTIVE)"),
+						cl::Hidden, cl::init(false) );
+
+
+static cl::opt<bool>	ClForgetFrees( "spm-forget-frees", cl::desc("Tell the runtime about memory freed or unmapped by modules with __spm_get calls"),
+						cl::Hidden, cl::init(true) );
+
+
+static cl::opt<bool>	ClLate( "spm-late", cl::desc("Also run the SPM transformation at the end of the -O1/-O2/-O3 pipelines"),
+						cl::Hidden, cl::init(false) );
+
+
 static cl::opt<std::string>	ClFunc( "spm-pthread-function", cl::desc("Only analyze/transform the given function"),
 							cl::Hidden, cl::init("") );
 
@@ -54,6 +79,18 @@ static cl::opt<std::string>	ClFunc( "spm-pthread-function", cl::desc("Only analy
 static RegisterPass<SelectivePageMigration> X( "spm", "ccNUMA selective page migration transformation");
 char SelectivePageMigration::ID = 0;
 
+
+// With -spm-late, also run at the end of the standard -O1/-O2/-O3 pipelines,
+//so that loading the library into clang ("-Xclang -load -Xclang
+//SelectivePageMigration.so -mllvm -spm-late") migrates the optimized code
+//without a separate opt step. Merely loading the library adds nothing.
+static void addSelectivePageMigration(const PassManagerBuilder &, PassManagerBase &PM) {
+	if (ClLate)
+		PM.add( new SelectivePageMigration() );
+}
+
+static RegisterStandardPasses Y( PassManagerBuilder::EP_OptimizerLast, addSelectivePageMigration );
+
 #define SPM_DEBUG(X) { if (ClDebug) {X;} }
 
 /* ***************************************************************** */
@@ -62,10 +99,15 @@ char SelectivePageMigration::ID = 0;
 
 void SelectivePageMigration::getAnalysisUsage(AnalysisUsage &AU) const {
 
+	//optimized code may lack preheaders & single backedges; at -O0 (plain
+	//-spm) the IR is left as it was and such loops are skipped
+	if (ClLate)
+		AU.addRequiredID(LoopSimplifyID);
 	AU.addRequired<DataLayout>();  
 	AU.addRequired<DominatorTree>();
 	AU.addRequired<LoopInfo>();
 	
+	AU.addRequired<LoopInfoExpr>();
 	AU.addRequired<ReduceIndexation>();
 	AU.addRequired<RelativeExecutions>();
 	AU.addRequired<RelativeMinMax>();
@@ -82,9 +124,11 @@ bool SelectivePageMigration::runOnFunction(Function &F) {
 	DT_  = &getAnalysis<DominatorTree>();
 	LI_  = &getAnalysis<LoopInfo>();
 		
+	LIE_ = &getAnalysis<LoopInfoExpr>();
 	RI_  = &getAnalysis<ReduceIndexation>();
 	RE_  = &getAnalysis<RelativeExecutions>();
 	RMM_ = &getAnalysis<RelativeMinMax>();
+	SPI_ = &getAnalysis<SymPyInterface>();
 	GWF_ = &getAnalysis<GetWorkerFunctions>();
 
 	Module_  = F.getParent();
@@ -128,13 +172,39 @@ bool SelectivePageMigration::runOnFunction(Function &F) {
 			Constant *TLock = Module_->getOrInsertFunction("__spm_thread_lock", FType);
 			TLockInst = IRBld_lock.CreateCall(TLock);
 			
-			IRBuilder<> IRBld_unlock(  &( *F.back().getTerminator() )  );
+			//unlock at every return, as in main above; without -mergereturn
+			//there may be several
 			TLock = Module_->getOrInsertFunction("__spm_thread_unlock", FType);
-			TLockInst = IRBld_unlock.CreateCall(TLock);
+			for (auto &BB : F) {
+				TerminatorInst *TI = BB.getTerminator();
+				if ( isa<ReturnInst>(TI) ) {
+					IRBuilder<> IRBld_unlock(TI);
+					TLockInst = IRBld_unlock.CreateCall(TLock);
+				}
+			}
 		}
 	
 	} //if (ClThreadLock == true)
 
+	//copies of arrays shared with the threads may be stale once the program
+	//wrote them between one round of threads and the next
+	if (ClReplicate) {
+		FunctionType *FType = FunctionType::get(VoidTy, ArrayRef<Type*>(), false);
+		Constant *InvalidateAll = Module_->getOrInsertFunction("__spm_invalidate_all", FType);
+
+		std::vector<Instruction*> Creates;
+		for (auto &BB : F)
+			for (auto &I : BB)
+				if ( CallInst *CI = dyn_cast<CallInst>(&I) )
+					if ( CI->getCalledFunction() != nullptr && CI->getCalledFunction()->getName() == "pthread_create" )
+						Creates.push_back(CI);
+
+		for (auto CI : Creates) {
+			IRBuilder<> IRB(CI);
+			IRB.CreateCall(InvalidateAll);
+		}
+	}
+
 	if ( !ClFunc.empty() && F.getName() != ClFunc ) {
 		SPM_DEBUG(dbgs() << "SelectivePageMigration: skipping function " << F.getName() << "\n");
 		return false;
@@ -150,11 +220,30 @@ bool SelectivePageMigration::runOnFunction(Function &F) {
 	Calls_.clear();
 	LoadsToInsert.clear();
 
-	std::vector<Type*> ReuseFnFormals = { VoidPtrTy, IntTy, IntTy, IntTy };
+	std::vector<Type*> ReuseFnFormals = { VoidPtrTy, IntTy, IntTy, IntTy, IntTy };
 	FunctionType *ReuseFnType = FunctionType::get(VoidTy, ReuseFnFormals, false);
 	
 	ReuseFn_ = F.getParent()->getOrInsertFunction("__spm_get", ReuseFnType);
 
+	std::vector<Type*> LoopFnFormals = { IntTy };
+	FunctionType *LoopFnType = FunctionType::get(VoidTy, LoopFnFormals, false);
+
+	LoopBeginFn_ = Module_->getOrInsertFunction("__spm_loop_begin", LoopFnType);
+	LoopEndFn_   = Module_->getOrInsertFunction("__spm_loop_end", LoopFnType);
+
+	std::vector<Type*> ReleaseFnFormals = { VoidPtrTy, IntTy, IntTy };
+	FunctionType *ReleaseFnType = FunctionType::get(VoidTy, ReleaseFnFormals, false);
+	ReleaseFn_ = Module_->getOrInsertFunction("__spm_release", ReleaseFnType);
+
+	if (ClReplicate) {
+		FunctionType *ReplicateFnType = FunctionType::get(VoidPtrTy, ReuseFnFormals, false);
+		ReplicateFn_ = Module_->getOrInsertFunction("__spm_replicate", ReplicateFnType);
+
+		std::vector<Type*> InvalidateFnFormals = { VoidPtrTy, IntTy, IntTy };
+		FunctionType *InvalidateFnType = FunctionType::get(VoidTy, InvalidateFnFormals, false);
+		InvalidateFn_ = Module_->getOrInsertFunction("__spm_invalidate", InvalidateFnType);
+	}
+
 	std::set<BasicBlock*> Processed;
 	auto Entry = DT_->getRootNode();
   
@@ -188,6 +277,16 @@ bool SelectivePageMigration::runOnFunction(Function &F) {
 
 	
 	bool ret_val = ( Calls_.empty() ) ? false : true; //if there are calls to be inserted, the program is modified, so it must return true
+
+	//stores whose range is invalidated both before and after their loop;
+	//the range is only known at the exit if the preheader dominates it
+	std::set<Instruction*> Invalidating;
+	if (ClReplicate)
+		for (auto &CI : Calls_)
+			if ( CI.Final != nullptr && DT_->dominates(CI.Preheader, CI.Final) )
+				for (auto Access : CI.Accesses)
+					if ( isa<StoreInst>(Access) )
+						Invalidating.insert(Access);
 	
 	for (auto &CI : Calls_) { //this for creates all the calls to the __spm_get function
 
@@ -222,10 +321,80 @@ bool SelectivePageMigration::runOnFunction(Function &F) {
 		else
 			VoidArray = IRB.CreateBitCast(CI.Array, VoidPtrTy);
 		
-		std::vector<Value*> Args = { VoidArray, CI.Min, CI.Max, CI.Reuse };
+		Value *Site = ConstantInt::get( IntTy, createSite(F, CI) );
+
+		//time every execution of the loop, so the runtime can tell whether
+		//migrating for this site pays off; only for loops with a single exit
+		CallInst *LoopEnd = nullptr;
+		if (ClAdaptive && CI.Final != nullptr) {
+			IRB.CreateCall(LoopBeginFn_, Site);
+
+			IRBuilder<> IRBEnd( CI.Final, CI.Final->getFirstInsertionPt() );
+			LoopEnd = IRBEnd.CreateCall(LoopEndFn_, Site);
+		}
+
+		//loops that only read the array use a copy on the node of the thread,
+		//which the loops that write it invalidate; the copy is only safe if
+		//no write to the array can bypass them
+		if (ClReplicate) {
+			Loop *L = LI_->getLoopFor( CI.Preheader->getTerminator()->getSuccessor(0) );
+			bool Stores = false;
+
+			for (auto Access : CI.Accesses)
+				Stores |= isa<StoreInst>(Access);
+
+			if ( !Stores && !LoadsToInsert.count(CI.Array) && isReadOnlyIn(CI.Array, L, CI.Accesses)
+					&& isOnlyWrittenBy(CI.Array, F, Invalidating) ) {
+				Value *End = IRB.CreateAdd( CI.Max, ConstantInt::get(IntTy, CI.Size) );
+				std::vector<Value*> Args = { VoidArray, CI.Min, End, CI.Reuse, Site };
+				Value *Local = IRB.CreateBitCast( IRB.CreateCall(ReplicateFn_, Args), CI.Array->getType() );
+
+				std::vector<Instruction*> Users;
+				for (Value::use_iterator UI = CI.Array->use_begin(), UE = CI.Array->use_end(); UI != UE; ++UI)
+					if ( Instruction *U = dyn_cast<Instruction>(*UI) )
+						if ( L->contains(U) )
+							Users.push_back(U);
+
+				for (auto U : Users)
+					U->replaceUsesOfWith(CI.Array, Local);
+
+				SPM_DEBUG(dbgs() << "\nSelectivePageMigration: replicating " << *CI.Array << " for loop " << L->getHeader()->getName() << "\n\n");
+				continue;
+			}
+
+			if (Stores) {
+				//up to the end of the last access, as for __spm_replicate
+				Value *End = IRB.CreateAdd( CI.Max, ConstantInt::get(IntTy, CI.Size) );
+				std::vector<Value*> Args = { VoidArray, CI.Min, End };
+				IRB.CreateCall(InvalidateFn_, Args);
+
+				//again once the loop is done, as a copy refreshed while it ran
+				//may hold half of its writes
+				if ( CI.Final != nullptr && DT_->dominates(CI.Preheader, CI.Final) ) {
+					IRBuilder<> IRBExit( CI.Final, LoopEnd != nullptr ? ++BasicBlock::iterator(LoopEnd)
+																	 : CI.Final->getFirstInsertionPt() );
+					IRBExit.CreateCall(InvalidateFn_, Args);
+				}
+			}
+		}
+
+		std::vector<Value*> Args = { VoidArray, CI.Min, CI.Max, CI.Reuse, Site };
 		CallInst *CR = IRB.CreateCall(ReuseFn_, Args);
 
 		SPM_DEBUG(dbgs() << "\nSelectivePageMigration: call instruction: " << *CR << "\n\n");
+
+		//hand the range back once the loop is done with it, so that another
+		//thread may take it at once; the range is only known at the exit if
+		//the preheader dominates it
+		if ( CI.Final != nullptr && DT_->dominates(CI.Preheader, CI.Final) ) {
+			IRBuilder<> IRBRelease( CI.Final, LoopEnd != nullptr ? ++BasicBlock::iterator(LoopEnd)
+															   : CI.Final->getFirstInsertionPt() );
+
+			std::vector<Value*> ReleaseArgs = { VoidArray, CI.Min, CI.Max };
+			CallInst *CRel = IRBRelease.CreateCall(ReleaseFn_, ReleaseArgs);
+
+			SPM_DEBUG(dbgs() << "SelectivePageMigration: release call: " << *CRel << "\n\n");
+		}
 	} //for (auto &CI : Calls_)
 
 
@@ -233,6 +402,58 @@ bool SelectivePageMigration::runOnFunction(Function &F) {
 }
 
 
+// Tells the runtime to forget what it knows of memory before the module
+//frees or unmaps it, as the same pages may come back for other data:
+//__spm_forget before munmap, __spm_forget_block before free, realloc and
+//delete. Memory may be freed anywhere, so every function is instrumented.
+//Returns whether any call was inserted.
+bool SelectivePageMigration::forgetFreedMemory(Module &M) {
+	LLVMContext &C = M.getContext();
+
+	IntegerType	*IntTy		= IntegerType::getInt64Ty(C);
+	PointerType	*VoidPtrTy	= PointerType::getInt8PtrTy(C);
+	Type		*VoidTy		= Type::getVoidTy(C);
+
+	std::vector<CallInst*> Frees;
+	for (auto &F : M)
+		for (auto &BB : F)
+			for (auto &I : BB)
+				if ( CallInst *CI = dyn_cast<CallInst>(&I) )
+					if ( Function *Callee = CI->getCalledFunction() ) {
+						StringRef Name = Callee->getName();
+
+						if ( (Name == "munmap" && CI->getNumArgOperands() == 2)
+								|| ((Name == "free" || Name == "realloc" || Name == "_ZdlPv" || Name == "_ZdaPv")
+									&& CI->getNumArgOperands() >= 1) )
+							Frees.push_back(CI);
+					}
+
+	if ( Frees.empty() )
+		return false;
+
+	std::vector<Type*> ForgetFnFormals = { VoidPtrTy, IntTy };
+	ForgetFn_ = M.getOrInsertFunction("__spm_forget", FunctionType::get(VoidTy, ForgetFnFormals, false));
+
+	std::vector<Type*> ForgetBlockFnFormals = { VoidPtrTy };
+	ForgetBlockFn_ = M.getOrInsertFunction("__spm_forget_block", FunctionType::get(VoidTy, ForgetBlockFnFormals, false));
+
+	for (auto CI : Frees) {
+		IRBuilder<> IRB(CI);
+		Value *Ptr = IRB.CreatePointerCast(CI->getArgOperand(0), VoidPtrTy);
+		CallInst *CF;
+
+		if ( CI->getCalledFunction()->getName() == "munmap" )
+			CF = IRB.CreateCall2(ForgetFn_, Ptr, IRB.CreateIntCast(CI->getArgOperand(1), IntTy, false));
+		else
+			CF = IRB.CreateCall(ForgetBlockFn_, Ptr);
+
+		SPM_DEBUG(dbgs() << "SelectivePageMigration: forget call: " << *CF << " before " << *CI << "\n");
+	}
+
+	return true;
+}
+
+
 bool SelectivePageMigration::generateCallFor(Loop *L, Instruction *I) {
 	if (!isa<LoadInst>(I) && !isa<StoreInst>(I))
 		return false;
@@ -278,6 +499,12 @@ bool SelectivePageMigration::generateCallFor(Loop *L, Instruction *I) {
 
 	BasicBlock *Preheader = Final->getLoopPreheader();
 	BasicBlock *Exit      = Final->getExitBlock();
+
+	if (Preheader == nullptr) {
+		SPM_DEBUG(dbgs() << "SelectivePageMigration: loop " << Final->getHeader()->getName() << " has no preheader\n");
+		SPM_DEBUG(dbgs() << "The instruction: " << *I << " won't be optimized\n");
+		return false;
+	}
   
 	if ( Instruction *AI = dyn_cast<Instruction>(Array) ) {
 		if ( !DT_->dominates(AI->getParent(), Preheader) && AI->getParent() != Preheader ) {
@@ -355,7 +582,11 @@ bool SelectivePageMigration::generateCallFor(Loop *L, Instruction *I) {
 	SPM_DEBUG(dbgs() << "SelectivePageMigration: values for reuse, min, max:\n*** Reuse: "<< *Reuse << "\n*** Min: " << *Min << "\n*** Max: " << *Max << "\n\n");
 
 
-	CallInfo CI = { Preheader, Exit, Array, Min, Max, Reuse };
+	int Direction = getTraversalDirection(Final, Subscript);
+
+	SPM_DEBUG(dbgs() << "SelectivePageMigration: traversal direction of " << *Array << ": " << Direction << "\n");
+
+	CallInfo CI = { Preheader, Exit, Array, Min, Max, Reuse, I, Direction, Size, { I } };
 	auto Call = Calls_.insert(CI);
 	
 	if (!Call.second) {
@@ -370,6 +601,12 @@ bool SelectivePageMigration::generateCallFor(Loop *L, Instruction *I) {
 
 		SCI.Reuse = IRB.CreateAdd(SCI.Reuse, CI.Reuse);
 
+		if (SCI.Direction != CI.Direction)
+			SCI.Direction = 0;
+
+		SCI.Size = std::max(SCI.Size, CI.Size);
+		SCI.Accesses.push_back(I);
+
 		Calls_.erase(SCI);
 		Calls_.insert(SCI);
 	} // if (!Call.second)
@@ -378,6 +615,379 @@ bool SelectivePageMigration::generateCallFor(Loop *L, Instruction *I) {
 }
 
 
+// Tells whether successive iterations of L move Subscript up (1) or down
+//(-1) the array, from the sign of its change over one step of L's
+//induction variable; 0 if that is not a known constant.
+int SelectivePageMigration::getTraversalDirection(Loop *L, const Expr &Subscript) {
+	PHINode *Indvar;
+	Expr Start, End, Step;
+
+	if ( !LIE_->getLoopInfo(L, Indvar, Start, End, Step) )
+		return 0;
+
+	Expr Delta = ( Subscript.subs(Expr(Indvar), Expr(Indvar) + Step) - Subscript ).expand();
+
+	if ( !Delta.isConstant() )
+		return 0;
+
+	return Delta.isPositive() ? 1 : (Delta.isNegative() ? -1 : 0);
+}
+
+
+// Tells whether every memory access through V, or through GEPs and casts of
+//it, inside L is one of the loads in Accesses; any other use inside L, such
+//as a store, a call or a phi, may write the array or let the pointer escape.
+bool SelectivePageMigration::isReadOnlyIn(Value *V, Loop *L, const std::vector<Instruction*> &Accesses) {
+	for (Value::use_iterator UI = V->use_begin(), UE = V->use_end(); UI != UE; ++UI) {
+		Instruction *I = dyn_cast<Instruction>(*UI);
+
+		if (I == nullptr)
+			return false;
+
+		if ( isa<GetElementPtrInst>(I) || isa<BitCastInst>(I) ) {
+			if ( !isReadOnlyIn(I, L, Accesses) )
+				return false;
+		}
+
+		else if ( isa<LoadInst>(I) ) {
+			if ( L->contains(I) && std::find(Accesses.begin(), Accesses.end(), I) == Accesses.end() )
+				return false;
+		}
+
+		else if ( L->contains(I) ) {
+			SPM_DEBUG(dbgs() << "SelectivePageMigration: " << *V << " may be written by " << *I << "\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// Tells whether every write to the object V points into while F runs is one
+//of Stores. Objects private to F qualify if their address does not leave
+//it: internal globals and the results of noalias calls (malloc). Locals do
+//not, as another call may reuse their stack without invalidating the
+//copies. In the thread start routines, objects handed to the threads
+//qualify if the threads write nothing else that may be them.
+bool SelectivePageMigration::isOnlyWrittenBy(Value *V, Function &F, const std::set<Instruction*> &Stores) {
+	Value *Object = GetUnderlyingObject(V, DL_);
+	GlobalVariable *GV = dyn_cast<GlobalVariable>(Object);
+
+	if ( isNoAliasCall(Object) || (GV && GV->hasLocalLinkage()) )
+		return usesAreInstrumented(Object, F, Stores);
+
+	if ( !isa<AllocaInst>(Object) && GWF_->workers.count( F.getName().str() ) )
+		return workersOnlyWrite(Object, F, Stores);
+
+	SPM_DEBUG(dbgs() << "SelectivePageMigration: " << *V << " may be written outside " << F.getName() << "\n");
+	return false;
+}
+
+
+// Tells whether the thread start routines that GetWorkerFunctions found, and
+//the functions of the module they call, write only through the stores of F
+//in Stores, which invalidate what they write, or to variables other than
+//Object that no pointer can reach. The rest of the program is taken to write what the
+//threads read only before creating them or after joining them, and the
+//copies are invalidated before every pthread_create.
+bool SelectivePageMigration::workersOnlyWrite(Value *Object, Function &F, const std::set<Instruction*> &Stores) {
+	std::vector<Function*> Worklist;
+	std::set<Function*> Visited;
+
+	for (auto &Name : GWF_->workers) {
+		Function *W = Module_->getFunction(Name);
+
+		if ( W == nullptr || W->isDeclaration() ) {
+			SPM_DEBUG(dbgs() << "SelectivePageMigration: thread start routine " << Name << " is not in the module\n");
+			return false;
+		}
+
+		Worklist.push_back(W);
+	}
+
+	while ( !Worklist.empty() ) {
+		Function *G = Worklist.back();
+		Worklist.pop_back();
+
+		if ( !Visited.insert(G).second )
+			continue;
+
+		for (auto &BB : *G)
+			for (auto &I : BB) {
+				Value *Ptr = nullptr;
+
+				if ( G == &F && Stores.count(&I) )
+					continue;
+
+				if ( StoreInst *SI = dyn_cast<StoreInst>(&I) )
+					Ptr = SI->getPointerOperand();
+				else if ( AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(&I) )
+					Ptr = RMW->getPointerOperand();
+				else if ( AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(&I) )
+					Ptr = CX->getPointerOperand();
+
+				if ( Ptr != nullptr && !isUnreachableVariable(Ptr, Object) ) {
+					SPM_DEBUG(dbgs() << "SelectivePageMigration: thread code in " << G->getName() << " may write shared arrays: " << I << "\n");
+					return false;
+				}
+
+				if ( !isa<CallInst>(&I) && !isa<InvokeInst>(&I) )
+					continue;
+
+				ImmutableCallSite CS(&I);
+				const Function *Callee = CS.getCalledFunction();
+
+				if ( Callee != nullptr && (Callee->getName().startswith("__spm_") || CS.onlyReadsMemory()) )
+					continue;
+
+				if ( Callee != nullptr && !Callee->isDeclaration() ) {
+					Worklist.push_back( const_cast<Function*>(Callee) );
+					continue;
+				}
+
+				//library functions and intrinsics (memset) write what they are given
+				bool Known = Callee != nullptr;
+				for (auto Arg = CS.arg_begin(), ArgE = CS.arg_end(); Known && Arg != ArgE; ++Arg)
+					if ( (*Arg)->getType()->isPointerTy() && !isa<ConstantPointerNull>(*Arg) )
+						Known = isUnreachableVariable(*Arg, Object);
+
+				if (!Known) {
+					SPM_DEBUG(dbgs() << "SelectivePageMigration: thread code in " << G->getName() << " may write shared arrays: " << I << "\n");
+					return false;
+				}
+			}
+	}
+
+	return true;
+}
+
+
+// Tells whether Ptr points into a local or global variable, other than
+//Object, whose address is never stored, converted or handed to a function
+//of the module or to pthread_create, so that no pointer loaded from memory
+//or passed to a thread points into it. Library functions are taken not to
+//keep the pointers they are given.
+bool SelectivePageMigration::isUnreachableVariable(Value *Ptr, Value *Object) {
+	Value *Variable = GetUnderlyingObject(Ptr, DL_);
+
+	if ( Variable == Object || (!isa<AllocaInst>(Variable) && !isa<GlobalVariable>(Variable)) )
+		return false;
+
+	return !addressEscapes(Variable);
+}
+
+
+// Tells whether the address V, or a GEP or cast of it, escapes as above.
+bool SelectivePageMigration::addressEscapes(Value *V) {
+	for (Value::use_iterator UI = V->use_begin(), UE = V->use_end(); UI != UE; ++UI) {
+		User *U = *UI;
+
+		if ( ConstantExpr *CE = dyn_cast<ConstantExpr>(U) ) {
+			if ( CE->getOpcode() != Instruction::GetElementPtr && CE->getOpcode() != Instruction::BitCast )
+				return true;
+
+			if ( addressEscapes(CE) )
+				return true;
+		}
+
+		else if ( isa<GetElementPtrInst>(U) || isa<BitCastInst>(U) ) {
+			if ( addressEscapes(U) )
+				return true;
+		}
+
+		else if ( StoreInst *SI = dyn_cast<StoreInst>(U) ) {
+			if ( SI->getValueOperand() == V )
+				return true;
+		}
+
+		else if ( isa<CallInst>(U) || isa<InvokeInst>(U) ) {
+			ImmutableCallSite CS( cast<Instruction>(U) );
+			const Function *Callee = CS.getCalledFunction();
+
+			if ( Callee == nullptr || !Callee->isDeclaration() || Callee->getName() == "pthread_create" )
+				return true;
+		}
+
+		else if ( !isa<LoadInst>(U) && !isa<AtomicRMWInst>(U) && !isa<AtomicCmpXchgInst>(U) && !isa<CmpInst>(U) )
+			return true;
+	}
+
+	return false;
+}
+
+
+// Tells whether every use of the address V, or of GEPs and casts of it, is
+//in F and either loads from it or is one of Stores storing to it. Anything
+//else, such as a call, a phi or storing the address itself, may write the
+//object or let the address escape.
+bool SelectivePageMigration::usesAreInstrumented(Value *V, Function &F, const std::set<Instruction*> &Stores) {
+	for (Value::use_iterator UI = V->use_begin(), UE = V->use_end(); UI != UE; ++UI) {
+		if ( ConstantExpr *CE = dyn_cast<ConstantExpr>(*UI) ) {
+			if ( CE->getOpcode() != Instruction::GetElementPtr && CE->getOpcode() != Instruction::BitCast )
+				return false;
+
+			if ( !usesAreInstrumented(CE, F, Stores) )
+				return false;
+
+			continue;
+		}
+
+		Instruction *I = dyn_cast<Instruction>(*UI);
+
+		if ( I == nullptr || I->getParent()->getParent() != &F )
+			return false;
+
+		if ( isa<GetElementPtrInst>(I) || isa<BitCastInst>(I) ) {
+			if ( !usesAreInstrumented(I, F, Stores) )
+				return false;
+		}
+
+		else if ( StoreInst *SI = dyn_cast<StoreInst>(I) ) {
+			if ( SI->getValueOperand() == V || !Stores.count(SI) ) {
+				SPM_DEBUG(dbgs() << "SelectivePageMigration: " << *V << " written by " << *I << " outside the transformed loops\n");
+				return false;
+			}
+		}
+
+		else if ( !isa<LoadInst>(I) ) {
+			SPM_DEBUG(dbgs() << "SelectivePageMigration: " << *V << " may escape through " << *I << "\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+uint64_t SelectivePageMigration::createSite(Function &F, const CallInfo &CI) {
+	SiteInfo SI;
+
+	SI.Function  = F.getName().str();
+	SI.Loop      = CI.Preheader->getTerminator()->getSuccessor(0)->getName().str();
+	SI.Line      = 0;
+	SI.Direction = CI.Direction;
+
+	if ( CI.Array->hasName() )
+		SI.Array = CI.Array->getName().str();
+	else if ( LoadInst *L = dyn_cast<LoadInst>(CI.Array) )
+		SI.Array = L->getPointerOperand()->getName().str();
+
+	if ( MDNode *N = CI.Access->getMetadata(LLVMContext::MD_dbg) ) {
+		DILocation Loc(N);
+		SI.File = Loc.getFilename().str();
+		SI.Line = Loc.getLineNumber();
+	}
+
+	// FNV-1a of the names that identify the site, so the same loop gets the
+	//same ID in every build of the program.
+	uint64_t Id = 14695981039346656037ULL;
+	std::vector<std::string> Keys = { Module_->getModuleIdentifier(), SI.Function, SI.Loop, SI.Array };
+
+	for (auto &Key : Keys) {
+		for (auto Ch : Key)
+			Id = (Id ^ (unsigned char)Ch) * 1099511628211ULL;
+		Id = (Id ^ 0xff) * 1099511628211ULL;
+	}
+
+	Id &= 0x7fffffffffffffffULL; //keep it positive as a long
+	while ( SiteIds_.count(Id) )
+		Id = (Id + 1) & 0x7fffffffffffffffULL;
+
+	SI.Id = Id;
+	SiteIds_.insert(Id);
+	Sites_.push_back(SI);
+
+	SPM_DEBUG(dbgs() << "SelectivePageMigration: site " << Id << ": " << SI.Function << ", " << SI.Loop << ", " << SI.File << ":" << SI.Line << ", " << SI.Array << "\n");
+
+	return Id;
+}
+
+
+static Constant *getStringConstant(Module &M, const std::string &Str) {
+	LLVMContext &C = M.getContext();
+
+	Constant *Init = ConstantDataArray::getString(C, Str);
+	GlobalVariable *GV = new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage, Init, ".spm.str");
+
+	Constant *Zero = ConstantInt::get(Type::getInt32Ty(C), 0);
+	std::vector<Constant*> Idx = { Zero, Zero };
+
+	return ConstantExpr::getGetElementPtr(GV, Idx);
+}
+
+
+// Emits the table of call sites of this module and a constructor that
+//registers it with the runtime through __spm_register_sites(Sites, NumSites).
+bool SelectivePageMigration::doFinalization(Module &M) {
+	SPM_DEBUG(
+		if (LIE_)
+			LIE_->printCacheStats(dbgs());
+		if (RE_)
+			RE_->printCacheStats(dbgs());
+		if (SPI_)
+			SPI_->printCacheStats(dbgs());
+	);
+
+	if ( Sites_.empty() )
+		return false;
+
+	//only modules that migrate anything pay for the calls at every free
+	if (ClForgetFrees)
+		forgetFreedMemory(M);
+
+	LLVMContext &C = M.getContext();
+
+	Type		*VoidTy		= Type::getVoidTy(C);
+	IntegerType	*Int32Ty	= IntegerType::getInt32Ty(C);
+	IntegerType	*IntTy		= IntegerType::getInt64Ty(C);
+	PointerType	*VoidPtrTy	= PointerType::getInt8PtrTy(C);
+
+	// Must match SiteInfo in the runtime.
+	std::vector<Type*> SiteFields = { IntTy, VoidPtrTy, VoidPtrTy, VoidPtrTy, Int32Ty, Int32Ty, VoidPtrTy };
+	StructType *SiteTy = StructType::get(C, SiteFields);
+
+	std::vector<Constant*> Entries;
+	for (auto &SI : Sites_) {
+		std::vector<Constant*> Fields = {
+			ConstantInt::get(IntTy, SI.Id),
+			getStringConstant(M, SI.Function),
+			getStringConstant(M, SI.Loop),
+			getStringConstant(M, SI.File),
+			ConstantInt::get(Int32Ty, SI.Line),
+			ConstantInt::get(Int32Ty, SI.Direction, true),
+			getStringConstant(M, SI.Array)
+		};
+		Entries.push_back( ConstantStruct::get(SiteTy, Fields) );
+	}
+
+	ArrayType *TableTy = ArrayType::get(SiteTy, Entries.size());
+	GlobalVariable *Table = new GlobalVariable(M, TableTy, true, GlobalValue::InternalLinkage,
+											   ConstantArray::get(TableTy, Entries), "__spm_sites");
+
+	std::vector<Type*> RegisterFormals = { VoidPtrTy, IntTy };
+	FunctionType *RegisterTy = FunctionType::get(VoidTy, RegisterFormals, false);
+	Constant *Register = M.getOrInsertFunction("__spm_register_sites", RegisterTy);
+
+	FunctionType *CtorTy = FunctionType::get(VoidTy, ArrayRef<Type*>(), false);
+	Function *Ctor = Function::Create(CtorTy, GlobalValue::InternalLinkage, "__spm_register_sites_ctor", &M);
+
+	IRBuilder<> IRB( BasicBlock::Create(C, "entry", Ctor) );
+	std::vector<Value*> Args = { IRB.CreateBitCast(Table, VoidPtrTy), ConstantInt::get(IntTy, Sites_.size()) };
+	IRB.CreateCall(Register, Args);
+	IRB.CreateRetVoid();
+
+	appendToGlobalCtors(M, Ctor, 65535);
+
+	SPM_DEBUG(dbgs() << "SelectivePageMigration: emitted " << Sites_.size() << " call sites\n");
+
+	Sites_.clear();
+	SiteIds_.clear();
+
+	return true;
+}
+
+
 bool SelectivePageMigration::canGenerateExprAt(Expr *Ex, BasicBlock *BB) {
 	for ( auto &Sym : Ex->getSymbols() ) {
 		if ( Instruction *I = dyn_cast<Instruction>(Sym.getSymbolValue()) ) {
@@ -24,6 +24,7 @@
 #ifndef _SELECTIVEPAGEMIGRATION_H_
 #define _SELECTIVEPAGEMIGRATION_H_
 
+#include "LoopInfoExpr.h"
 #include "PythonInterface.h"
 #include "ReduceIndexation.h"
 #include "RelativeExecutions.h"
@@ -36,21 +37,26 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Instructions.h"
 
+#include <set>
+#include <string>
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 class SelectivePageMigration : public FunctionPass {
 public:
 	static char ID;
-	SelectivePageMigration() : FunctionPass(ID) { }
+	SelectivePageMigration() : FunctionPass(ID), LIE_(nullptr), RE_(nullptr), SPI_(nullptr) { }
 
 	virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 	virtual bool runOnFunction(Function &F);
+	virtual bool doFinalization(Module &M);
 
 private:
 	DataLayout         *DL_;
 	DominatorTree      *DT_;
 	LoopInfo           *LI_;
+	LoopInfoExpr       *LIE_;
 	ReduceIndexation   *RI_;
 	RelativeExecutions *RE_;
 	RelativeMinMax     *RMM_;
@@ -61,13 +67,29 @@ private:
 	Module      *Module_;
 	Constant    *ReuseFn_;
 	Constant    *ReuseFnDestroy_;
+	Constant    *LoopBeginFn_, *LoopEndFn_;
+	Constant    *ReplicateFn_, *InvalidateFn_;
+	Constant    *ReleaseFn_;
+	Constant    *ForgetFn_, *ForgetBlockFn_;
 
 	bool generateCallFor(Loop *L, Instruction *I);
+	bool forgetFreedMemory(Module &M);
 	bool canGenerateExprAt(Expr *Ex, BasicBlock *BB);
+	int getTraversalDirection(Loop *L, const Expr &Subscript);
+	bool isReadOnlyIn(Value *V, Loop *L, const std::vector<Instruction*> &Accesses);
+	bool isOnlyWrittenBy(Value *V, Function &F, const std::set<Instruction*> &Stores);
+	bool usesAreInstrumented(Value *V, Function &F, const std::set<Instruction*> &Stores);
+	bool workersOnlyWrite(Value *Object, Function &F, const std::set<Instruction*> &Stores);
+	bool isUnreachableVariable(Value *Ptr, Value *Object);
+	bool addressEscapes(Value *V);
 
 	struct CallInfo {
-		BasicBlock *Preheader, *Final;
+		BasicBlock *Preheader, *Final; //Final: exit block of the loop, if it has one
 		Value *Array, *Min, *Max, *Reuse;
+		Instruction *Access; //first access that required the call
+		int Direction;       //1 or -1 if the range is walked up or down, 0 if unknown
+		unsigned Size;       //of the largest access, in bytes
+		std::vector<Instruction*> Accesses; //every load and store the call covers
 
 		bool operator==(const CallInfo &Other) const {
 			return Preheader == Other.Preheader && Array == Other.Array;
@@ -83,6 +105,20 @@ private:
 	std::unordered_set<CallInfo, CallInfoHasher> Calls_;
 
 	std::unordered_map<Value*, Value*> LoadsToInsert;
+
+	// Metadata of every __spm_get call site in the module; emitted as a
+	//table that the runtime uses to report per-site statistics.
+	struct SiteInfo {
+		uint64_t Id;
+		std::string Function, Loop, File, Array;
+		unsigned Line;
+		int Direction;
+	};
+
+	uint64_t createSite(Function &F, const CallInfo &CI);
+
+	std::vector<SiteInfo> Sites_;
+	std::set<uint64_t>    SiteIds_;
 };
 
 #endif
@@ -0,0 +1,96 @@
+/* *********************************************************************
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * AND the GNU Lesser General Public License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors of this code:
+ *   Henrique Nazaré Santos  <hnsantos@gmx.com>
+ *   Guilherme G. Piccoli    <porcusbr@gmail.com>
+ *
+ * Publication:
+ *   Compiler support for selective page migration in NUMA
+ *   architectures. PACT 2014: 369-380.
+ *   <http://dx.doi.org/10.1145/2628071.2628077>
+********************************************************************* */
+#include "Summation.h"
+
+#include <vector>
+
+/* ****************************************************************** */
+/* ****************************************************************** */
+
+
+// Bernoulli numbers B0..BK, with B1 = +1/2 as Faulhaber's formula wants.
+static std::vector<Expr> bernoulli(unsigned K) {
+	std::vector<Expr> B(1, Expr(1L));
+	std::vector<long> Binomial(2, 1); //row m+1 of Pascal's triangle
+
+	for (unsigned M = 1; M <= K; ++M) {
+		//advance to row m+1
+		Binomial.push_back(1);
+		for (unsigned J = M; J > 0; --J)
+			Binomial[J] += Binomial[J - 1];
+
+		//sum_{j=0}^{m} C(m+1, j) B_j = 0
+		Expr Sum(0L);
+		for (unsigned J = 0; J < M; ++J)
+			Sum = Sum + Expr(Binomial[J]) * B[J];
+
+		B.push_back( (Expr(-1L) * Sum / (M + 1)).expand() );
+	}
+
+	if (K >= 1)
+		B[1] = Expr(1L, 2L);
+
+	return B;
+}
+
+
+// Sum of i^K for i from 1 to N, as a polynomial in N (Faulhaber's formula):
+//1/(K+1) sum_{j=0}^{K} C(K+1, j) B_j N^(K+1-j).
+static Expr powerSum(unsigned K, const Expr &N) {
+	std::vector<Expr> B = bernoulli(K);
+	Expr Sum(0L);
+	long Binomial = 1; //C(K+1, J)
+
+	for (unsigned J = 0; J <= K; ++J) {
+		Sum = Sum + Expr(Binomial) * B[J] * (N ^ (K + 1 - J));
+		Binomial = Binomial * (K + 1 - J) / (J + 1);
+	}
+
+	return Sum / (K + 1);
+}
+
+
+Expr summation(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper) {
+	if ( !Summand.isValid() || !Lower.isValid() || !Upper.isValid() )
+		return Expr::InvalidExpr();
+
+	if ( Lower.has(Var) || Upper.has(Var) )
+		return Expr::InvalidExpr();
+
+	Expr Poly = Summand.expand();
+	if ( !Poly.isPolynomial(Var) )
+		return Expr::InvalidExpr();
+
+	//sum_{i=a}^{b} i^k = S_k(b) - S_k(a - 1), for any integers a and b
+	Expr Sum(0L);
+	for (int K = 0, D = Poly.degree(Var); K <= D; ++K) {
+		Expr Coeff = Poly.coeff(Var, K);
+		if (Coeff == Expr(0L))
+			continue;
+
+		Sum = Sum + Coeff * ( powerSum(K, Upper) - powerSum(K, Lower - 1) );
+	}
+
+	return Sum.expand();
+}
@@ -0,0 +1,37 @@
+/* *********************************************************************
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * AND the GNU Lesser General Public License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors of this code:
+ *   Henrique Nazaré Santos  <hnsantos@gmx.com>
+ *   Guilherme G. Piccoli    <porcusbr@gmail.com>
+ *
+ * Publication:
+ *   Compiler support for selective page migration in NUMA
+ *   architectures. PACT 2014: 369-380.
+ *   <http://dx.doi.org/10.1145/2628071.2628077>
+********************************************************************* */
+#ifndef _SUMMATION_H_
+#define _SUMMATION_H_
+
+#include "Expr.h"
+
+// Closed form of the sum of Summand for Var from Lower to Upper, both
+//inclusive, where Summand is a polynomial in Var whose coefficients and
+//bounds may be any expressions not involving Var (symbols, rationals, min,
+//max). Var ranges over the integers, as in SymPy's summation, so
+//sum(1/Step, i, a, b) = (b - a + 1)/Step. Returns an invalid expression if
+//Summand is not a polynomial in Var.
+Expr summation(const Expr &Summand, const Expr &Var, const Expr &Lower, const Expr &Upper);
+
+#endif
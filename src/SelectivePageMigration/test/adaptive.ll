@@ -0,0 +1,36 @@
+; -spm-adaptive: every execution of a loop with a __spm_get is timed, with
+; __spm_loop_begin before the call and __spm_loop_end at the loop exit,
+; both with the ID of the site. Without it the loops carry no timing calls.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-adaptive -S < %s | FileCheck %s
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -S < %s | FileCheck %s --check-prefix=OFF
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; CHECK: define void @fill(
+; CHECK: call void @__spm_loop_begin(i64 [[ID:[0-9]+]])
+; CHECK-NEXT: call void @__spm_get(i8* {{.*}}, i64 [[ID]])
+; CHECK: for.end:
+; CHECK-NEXT: call void @__spm_loop_end(i64 [[ID]])
+; OFF: define void @fill(
+; OFF-NOT: call void @__spm_loop_
+; OFF: ret void
+define void @fill(i32* %a) nounwind uwtable {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
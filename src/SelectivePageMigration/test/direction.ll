@@ -0,0 +1,50 @@
+; Traversal direction of each site in the site table: 1 for a loop that
+; walks its array up, -1 for one that walks it down. The runtime migrates
+; chunked ranges in that order.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -S < %s | FileCheck %s
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; CHECK: @__spm_sites = internal constant [2 x {{.*}}] [{{.*}} { i64 {{[0-9]+}}, {{.*}}, i32 0, i32 1, {{.*}} }, {{.*}} { i64 {{[0-9]+}}, {{.*}}, i32 0, i32 -1, {{.*}} }]
+
+; for (i = 0; i < 1000; i++) a[i] = 0;
+define void @up(i32* %a) nounwind uwtable {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+; for (i = 999; i >= 0; i--) a[i] = 0;
+define void @down(i32* %a) nounwind uwtable {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 999, %entry ], [ %dec, %for.body ]
+  %cmp = icmp sge i64 %i, 0
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  %dec = add nsw i64 %i, -1
+  br label %for.cond
+
+for.end:
+  ret void
+}
@@ -0,0 +1,170 @@
+; The shapes the pass meets at the end of the -O2 pipeline (-spm-late):
+; vectorized accesses, array bases hoisted out of the loop, rotated loops
+; and functions with several returns.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-late -spm-loop-analysis=auto -spm-thread-lock -S < %s | FileCheck %s
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -O2 -spm-late -spm-loop-analysis=auto -S < %s | FileCheck %s --check-prefix=PIPELINE
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -O2 -S < %s | FileCheck %s --check-prefix=NOLATE
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%union.pthread_attr_t = type { i64, [48 x i8] }
+
+@table = global i32* null, align 8
+
+; A loop vectorized by four: <4 x i32> loads and stores through a cast of
+; the scalar GEP.
+;
+; CHECK: define void @vectorized(
+; CHECK: vector.ph:
+; CHECK: call void @__spm_get(i8* {{.*}})
+; CHECK: vector.body:
+; CHECK: load <4 x i32>*
+; CHECK: store <4 x i32>
+; PIPELINE: define void @vectorized(
+; PIPELINE: call void @__spm_get(
+; NOLATE-NOT: __spm_get
+define void @vectorized(i32* %a, i64 %n) nounwind uwtable {
+entry:
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %vector.ph, label %exit
+
+vector.ph:
+  br label %vector.body
+
+vector.body:
+  %index = phi i64 [ 0, %vector.ph ], [ %index.next, %vector.body ]
+  %gep = getelementptr inbounds i32* %a, i64 %index
+  %vp = bitcast i32* %gep to <4 x i32>*
+  %wide = load <4 x i32>* %vp, align 4
+  %add = add nsw <4 x i32> %wide, <i32 1, i32 1, i32 1, i32 1>
+  store <4 x i32> %add, <4 x i32>* %vp, align 4
+  %index.next = add i64 %index, 4
+  %cmp = icmp slt i64 %index.next, %n
+  br i1 %cmp, label %vector.body, label %exit.loopexit
+
+exit.loopexit:
+  br label %exit
+
+exit:
+  ret void
+}
+
+; The base of the array loaded from a global once, before the loop, as
+; LICM leaves it.
+;
+; CHECK: define i64 @hoisted_base(
+; CHECK: %base = load i32** @table
+; CHECK: for.body.lr.ph:
+; CHECK: call void @__spm_get(i8* {{.*}})
+; CHECK: for.body:
+define i64 @hoisted_base(i64 %n) nounwind uwtable {
+entry:
+  %base = load i32** @table, align 8
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %for.body.lr.ph, label %for.end
+
+for.body.lr.ph:
+  br label %for.body
+
+for.body:
+  %i = phi i64 [ 0, %for.body.lr.ph ], [ %i.next, %for.body ]
+  %sum = phi i64 [ 0, %for.body.lr.ph ], [ %sum.next, %for.body ]
+  %p = getelementptr inbounds i32* %base, i64 %i
+  %v = load i32* %p, align 4
+  %ext = sext i32 %v to i64
+  %sum.next = add nsw i64 %sum, %ext
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %n
+  br i1 %cmp, label %for.body, label %for.end.loopexit
+
+for.end.loopexit:
+  %sum.lcssa = phi i64 [ %sum.next, %for.body ]
+  br label %for.end
+
+for.end:
+  %r = phi i64 [ 0, %entry ], [ %sum.lcssa, %for.end.loopexit ]
+  ret i64 %r
+}
+
+; A rotated loop that exits when the incremented induction variable
+; reaches the bound, as -O2 writes "i < n" once it knows n > 0; the
+; pattern analysis does not take "!=", auto falls back to ScalarEvolution.
+;
+; CHECK: define void @rotated_ne(
+; CHECK: for.body.lr.ph:
+; CHECK: call void @__spm_get(i8* {{.*}})
+; CHECK: for.body:
+define void @rotated_ne(double* %a, i64 %n) nounwind uwtable {
+entry:
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %for.body.lr.ph, label %for.end
+
+for.body.lr.ph:
+  br label %for.body
+
+for.body:
+  %i = phi i64 [ 0, %for.body.lr.ph ], [ %i.next, %for.body ]
+  %p = getelementptr inbounds double* %a, i64 %i
+  store double 0.000000e+00, double* %p, align 8
+  %i.next = add nsw i64 %i, 1
+  %exitcond = icmp ne i64 %i.next, %n
+  br i1 %exitcond, label %for.body, label %for.end.loopexit
+
+for.end.loopexit:
+  br label %for.end
+
+for.end:
+  ret void
+}
+
+; A thread start routine with two returns: each of them unlocks.
+;
+; CHECK: define i8* @worker(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @__spm_thread_lock()
+; CHECK: early:
+; CHECK-NEXT: call void @__spm_thread_unlock()
+; CHECK-NEXT: ret i8* null
+; CHECK: late:
+; CHECK-NEXT: call void @__spm_thread_unlock()
+; CHECK-NEXT: ret i8* %arg
+define i8* @worker(i8* %arg) nounwind uwtable {
+entry:
+  %null = icmp eq i8* %arg, null
+  br i1 %null, label %early, label %late
+
+early:
+  ret i8* null
+
+late:
+  ret i8* %arg
+}
+
+; main with two returns: __spm_end runs before each of them.
+;
+; CHECK: define i32 @main(
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @__spm_init()
+; CHECK: one:
+; CHECK-NEXT: call void @__spm_end()
+; CHECK-NEXT: ret i32 1
+; CHECK: two:
+; CHECK-NEXT: call void @__spm_end()
+; CHECK-NEXT: ret i32 0
+define i32 @main(i32 %argc, i8** %argv) nounwind uwtable {
+entry:
+  %thread = alloca i64, align 8
+  %created = call i32 @pthread_create(i64* %thread, %union.pthread_attr_t* null, i8* (i8*)* @worker, i8* null) nounwind
+  %many = icmp sgt i32 %argc, 1
+  br i1 %many, label %one, label %two
+
+one:
+  ret i32 1
+
+two:
+  ret i32 0
+}
+
+declare i32 @pthread_create(i64*, %union.pthread_attr_t*, i8* (i8*)*, i8*) nounwind
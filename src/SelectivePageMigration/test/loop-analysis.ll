@@ -0,0 +1,144 @@
+; Induction variables, bounds and steps found by the three loop analyses
+; (-spm-loop-analysis) for a loop exiting at its header, a do-while loop
+; and two rotated loops. Where the pattern analysis finds the loop, the
+; others find the same start, end and step.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-loop-analysis=pattern -loop-info-expr-debug -S < %s 2>&1 | FileCheck %s --check-prefix=PATTERN
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-loop-analysis=scev -loop-info-expr-debug -S < %s 2>&1 | FileCheck %s --check-prefix=SCEV
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-loop-analysis=auto -loop-info-expr-debug -S < %s 2>&1 | FileCheck %s --check-prefix=AUTO
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; for (i = 0; i < 100; i++) a[i] = 0;  exits at the header.
+;
+; PATTERN: LoopInfoExpr: induction variable, start, end, step: {{.*}}%i = phi {{.*}} => (0, 99, +1)
+; SCEV: LoopInfoExpr: SCEV induction variable, start, end, step: {{.*}}%i = phi {{.*}} => (0, 99, +1)
+; AUTO: LoopInfoExpr: induction variable, start, end, step: {{.*}}%i = phi {{.*}} => (0, 99, +1)
+define void @header_exit(i32* %a) nounwind uwtable {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.inc ]
+  %cmp = icmp slt i64 %i, 100
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  br label %for.inc
+
+for.inc:
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+; i = 0; do { a[i] = 0; i++; } while (i < 100);  exits at the latch.
+;
+; PATTERN: LoopInfoExpr: induction variable, start, end, step: {{.*}}%j = phi {{.*}} => (0, 99, +1)
+; SCEV: LoopInfoExpr: SCEV induction variable, start, end, step: {{.*}}%j = phi {{.*}} => (0, 99, +1)
+; AUTO: LoopInfoExpr: induction variable, start, end, step: {{.*}}%j = phi {{.*}} => (0, 99, +1)
+define void @do_while(i32* %a) nounwind uwtable {
+entry:
+  br label %do.body
+
+do.body:
+  %j = phi i64 [ 0, %entry ], [ %j.next, %do.body ]
+  %p = getelementptr inbounds i32* %a, i64 %j
+  store i32 0, i32* %p, align 4
+  %j.next = add nsw i64 %j, 1
+  %cmp = icmp slt i64 %j.next, 100
+  br i1 %cmp, label %do.body, label %do.end
+
+do.end:
+  ret void
+}
+
+; for (i = 0; i < n; i++) a[i] = 0;  rotated by -O2 behind an n > 0 guard.
+;
+; PATTERN: LoopInfoExpr: induction variable, start, end, step: {{.*}}%k = phi {{.*}} => (0, -1+n.{{[0-9]+}}, +1)
+; SCEV: LoopInfoExpr: SCEV induction variable, start, end, step: {{.*}}%k = phi {{.*}} => (0, -1+n.{{[0-9]+}}, +1)
+; AUTO: LoopInfoExpr: induction variable, start, end, step: {{.*}}%k = phi {{.*}} => (0, -1+n.{{[0-9]+}}, +1)
+define void @rotated(i32* %a, i64 %n) nounwind uwtable {
+entry:
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %for.body.lr.ph, label %for.end
+
+for.body.lr.ph:
+  br label %for.body
+
+for.body:
+  %k = phi i64 [ 0, %for.body.lr.ph ], [ %k.next, %for.body ]
+  %p = getelementptr inbounds i32* %a, i64 %k
+  store i32 0, i32* %p, align 4
+  %k.next = add nsw i64 %k, 1
+  %cmp = icmp slt i64 %k.next, %n
+  br i1 %cmp, label %for.body, label %for.end.loopexit
+
+for.end.loopexit:
+  br label %for.end
+
+for.end:
+  ret void
+}
+
+; The same loop exiting on "!=", which only ScalarEvolution takes; auto
+; falls back to it.
+;
+; PATTERN: LoopInfoExpr: no loop info for loop at for.body: unsupported exit comparison predicate
+; SCEV: LoopInfoExpr: SCEV induction variable, start, end, step: {{.*}}%m = phi {{.*}} => (0, -1+n.{{[0-9]+}}, +1)
+; AUTO: LoopInfoExpr: SCEV induction variable, start, end, step: {{.*}}%m = phi {{.*}} => (0, -1+n.{{[0-9]+}}, +1)
+define void @rotated_ne(i32* %a, i64 %n) nounwind uwtable {
+entry:
+  %guard = icmp sgt i64 %n, 0
+  br i1 %guard, label %for.body.lr.ph, label %for.end
+
+for.body.lr.ph:
+  br label %for.body
+
+for.body:
+  %m = phi i64 [ 0, %for.body.lr.ph ], [ %m.next, %for.body ]
+  %p = getelementptr inbounds i32* %a, i64 %m
+  store i32 0, i32* %p, align 4
+  %m.next = add nsw i64 %m, 1
+  %cmp = icmp ne i64 %m.next, %n
+  br i1 %cmp, label %for.body, label %for.end.loopexit
+
+for.end.loopexit:
+  br label %for.end
+
+for.end:
+  ret void
+}
+
+; Every mode but pattern transforms all four loops.
+;
+; PATTERN: define void @header_exit(
+; PATTERN: call void @__spm_get(
+; PATTERN: define void @do_while(
+; PATTERN: call void @__spm_get(
+; PATTERN: define void @rotated(
+; PATTERN: call void @__spm_get(
+; PATTERN: define void @rotated_ne(
+; PATTERN-NOT: call void @__spm_get(
+; PATTERN: ret void
+; SCEV: define void @header_exit(
+; SCEV: call void @__spm_get(
+; SCEV: define void @do_while(
+; SCEV: call void @__spm_get(
+; SCEV: define void @rotated(
+; SCEV: call void @__spm_get(
+; SCEV: define void @rotated_ne(
+; SCEV: call void @__spm_get(
+; AUTO: define void @header_exit(
+; AUTO: call void @__spm_get(
+; AUTO: define void @do_while(
+; AUTO: call void @__spm_get(
+; AUTO: define void @rotated(
+; AUTO: call void @__spm_get(
+; AUTO: define void @rotated_ne(
+; AUTO: call void @__spm_get(
@@ -0,0 +1,59 @@
+; Ranges are handed back with __spm_release, at the exit of the loop they
+; were migrated for, when the preheader dominates that exit; otherwise
+; the range is not known there and no call is made.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -S < %s | FileCheck %s
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; CHECK: define void @fill(
+; CHECK: call void @__spm_get(i8* [[A:%[0-9]+]], i64 [[MIN:[^,]+]], i64 [[MAX:[^,]+]],
+; CHECK: for.end:
+; CHECK-NEXT: call void @__spm_release(i8* [[A]], i64 [[MIN]], i64 [[MAX]])
+define void @fill(i32* %a) nounwind uwtable {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+; The exit is also reached around the loop, from the entry.
+;
+; CHECK: define void @shared_exit(
+; CHECK: call void @__spm_get(
+; CHECK-NOT: __spm_release
+; CHECK: ret void
+define void @shared_exit(i32* %a, i1 %skip) nounwind uwtable {
+entry:
+  br i1 %skip, label %for.end, label %for.ph
+
+for.ph:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %for.ph ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
@@ -0,0 +1,98 @@
+; -spm-replicate: a thread start routine reads an array it loads from a
+; global, as benchmarks/easy_prod.cpp does, and writes another one in the
+; same loop. The array read is replicated, the one written is invalidated
+; before and after the loop, and every copy is invalidated before the
+; threads are created. A function that no thread starts migrates the same
+; array instead.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-replicate -S < %s | FileCheck %s --check-prefix=REP
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-replicate -S < %s | FileCheck %s --check-prefix=INV
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -spm-replicate -S < %s | FileCheck %s --check-prefix=CREATE
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%union.pthread_attr_t = type { i64, [48 x i8] }
+
+@matrices = global double* null, align 8
+@outputs = global double* null, align 8
+
+; REP: define double @reader(
+; REP-NOT: __spm_replicate
+; REP: call void @__spm_get(
+define double @reader() nounwind uwtable {
+entry:
+  %B = load double** @matrices, align 8
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %sum = phi double [ 0.000000e+00, %entry ], [ %add, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %pb = getelementptr inbounds double* %B, i64 %i
+  %b = load double* %pb, align 8
+  %add = fadd double %sum, %b
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret double %sum
+}
+
+; REP: define i8* @worker(
+; REP: [[COPY:%[0-9]+]] = call i8* @__spm_replicate(
+; REP: [[B:%[0-9]+]] = bitcast i8* [[COPY]] to double*
+; REP: for.body:
+; REP: getelementptr inbounds double* [[B]], i64 %i
+;
+; INV: define i8* @worker(
+; INV: call void @__spm_invalidate(
+; INV: for.cond:
+; INV: for.end:
+; INV: call void @__spm_invalidate(
+; INV: ret i8* null
+define i8* @worker(i8* %arg) nounwind uwtable {
+entry:
+  %B = load double** @matrices, align 8
+  %out = load double** @outputs, align 8
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %pb = getelementptr inbounds double* %B, i64 %i
+  %b = load double* %pb, align 8
+  %po = getelementptr inbounds double* %out, i64 %i
+  store double %b, double* %po, align 8
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret i8* null
+}
+
+; CREATE: define i32 @main(
+; CREATE: call void @__spm_invalidate_all()
+; CREATE-NEXT: call i32 @pthread_create(
+define i32 @main(i32 %argc, i8** %argv) nounwind uwtable {
+entry:
+  %thread = alloca i64, align 8
+  %m = call noalias i8* @malloc(i64 8000) nounwind
+  %md = bitcast i8* %m to double*
+  store double* %md, double** @matrices, align 8
+  %o = call noalias i8* @malloc(i64 8000) nounwind
+  %od = bitcast i8* %o to double*
+  store double* %od, double** @outputs, align 8
+  %created = call i32 @pthread_create(i64* %thread, %union.pthread_attr_t* null, i8* (i8*)* @worker, i8* null) nounwind
+  ret i32 0
+}
+
+declare noalias i8* @malloc(i64) nounwind
+
+declare i32 @pthread_create(i64*, %union.pthread_attr_t*, i8* (i8*)*, i8*) nounwind
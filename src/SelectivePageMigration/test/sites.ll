@@ -0,0 +1,39 @@
+; Call site IDs: every __spm_get passes the ID of its site, and the module
+; gets a table of its sites (ID, function, loop header, file, line,
+; direction, array) and a constructor that registers it.
+;
+; RUN: opt -load %llvmshlibdir/SelectivePageMigration%shlibext -spm -S < %s | FileCheck %s
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+; CHECK: c"fill\00"
+; CHECK: c"for.cond\00"
+; CHECK: c"a\00"
+; CHECK: @__spm_sites = internal constant [1 x { i64, i8*, i8*, i8*, i32, i32, i8* }] [{ i64, i8*, i8*, i8*, i32, i32, i8* } { i64 [[ID:[0-9]+]],
+; CHECK: @llvm.global_ctors = appending global {{.*}} @__spm_register_sites_ctor
+
+; CHECK: define void @fill(
+; CHECK: call void @__spm_get(i8* {{.*}}, i64 [[ID]])
+; CHECK: for.cond:
+define void @fill(i32* %a) nounwind uwtable {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, 1000
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %p = getelementptr inbounds i32* %a, i64 %i
+  store i32 0, i32* %p, align 4
+  %inc = add nsw i64 %i, 1
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+; CHECK: define internal void @__spm_register_sites_ctor()
+; CHECK: call void @__spm_register_sites(i8* bitcast ([1 x { i64, i8*, i8*, i8*, i32, i32, i8* }]* @__spm_sites to i8*), i64 1)